@@ -47,9 +47,26 @@
 
 /************System include***********************************************/
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -65,30 +82,299 @@
 enum REQ_STATE
   {
     FREE,
-    USED
+    USED,
+    REFUSED     // kma_malloc() returned NULL, so a FREE has nothing to free
   };
 
 typedef struct mem
 {
   int size;
   void* ptr;
-  void* value; // to check correctness
   enum REQ_STATE state;
 } mem_t;
 
+// the content of a block is a function of its request id and offset,
+// so it is checked without a copy: the word at offset 8k holds
+// seed + k * PATTERNSTEP, which fill() and check() compute two words
+// at a time
+typedef unsigned long pattern_t __attribute__ ((vector_size (16)));
+
+#define PATTERNSTEP 0xD6E8FEB86659FD93UL
+
+// one line of the trace file, and one record of a binary trace; a
+// FREE has no size
+typedef struct op
+{
+  int id;
+  int size;
+} op_t;
+
+#define FREESIZE -1
+
+// a binary trace is this header followed by its op_t records, in host
+// byte order, so it is replayed from the mapped file as it is
+typedef struct trace_header
+{
+  char magic[8];
+  int n_ops;
+  int n_req;
+} trace_header_t;
+
+#define TRACEMAGIC "KMATRAC1"
+
+// a live request of a streamed trace, in an open addressing table
+// keyed by its id
+typedef struct live
+{
+  int id;
+  mem_t mem;
+} live_t;
+
+// the requests of a forked replay and the next operation, in memory
+// shared by the two processes
+typedef struct fork_table
+{
+  int next;
+  mem_t requests[];
+} fork_table_t;
+
+typedef struct live_table
+{
+  live_t* slots;
+  int bits;
+  long count;
+} live_table_t;
+
+// id of an empty slot
+#define NOID -1
+
+// slots of a new live table, a power of two
+#define MINLIVESLOTS 1024
+
+// buffer of a streamed trace
+#define STREAMBUFSIZE (1 << 20)
+
+// latencies are counted in log-linear buckets, as in an HDR
+// histogram: 2^LATSUBBITS linear buckets per power of two, so a
+// bucket is at most 1/16 wider than its values
+#define LATSUBBITS 4
+#define LATSUB (1 << LATSUBBITS)
+#define LATBUCKETS ((64 - LATSUBBITS + 1) * LATSUB)
+
+// histograms per request size, by power of two from 16 bytes up, and
+// one over all sizes
+#define NUMSIZECLASSES 12
+#define ALLSIZES NUMSIZECLASSES
+
+// slowest operations kept by --latency without a count
+#define DEFAULTSLOWEST 10
+
+// samples of the allocation output are handed to its writer thread a
+// block at a time
+#define SAMPLEBLOCK 4096
+#define NUMSAMPLEBLOCKS 4
+
+// longest line of the allocation output
+#define MAXSAMPLELINE 160
+
+enum METRICS_FORMAT
+  {
+    METRICS_DAT,
+    METRICS_CSV,
+    METRICS_JSON
+  };
+
+// the state after one operation
+typedef struct sample
+{
+  long op;
+  int requested;
+  long allocated;
+  long ns;
+} sample_t;
+
+// the allocation output; the replay fills the blocks in turn and the
+// writer thread formats and writes the full ones, in the same order
+typedef struct metrics
+{
+  FILE* out;
+  enum METRICS_FORMAT format;
+  long interval;
+  double decimate;
+  sample_t blocks[NUMSAMPLEBLOCKS][SAMPLEBLOCK];
+  int fill[NUMSAMPLEBLOCKS];
+  long produced;
+  long written;
+  bool closing;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  pthread_t writer;
+  struct timespec start;
+  sample_t taken;     // the last sample in the output
+  sample_t latest;    // the last operation, sampled or not
+} metrics_t;
+
+// timed repetitions of --bench without a count
+#define DEFAULTREPS 5
+
+// two-sided 95% quantiles of Student's t distribution by degrees of
+// freedom, from 1 up; past the table the normal quantile is used
+#define TQUANTILES { 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, \
+		     2.262, 2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, \
+		     2.110, 2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064, \
+		     2.060, 2.056, 2.052, 2.048, 2.045, 2.042 }
+#define NORMALQUANTILE 1.960
+
+// one thread of a threaded replay, with its share of the trace and
+// the turn of each of its operations among those on the same id
+typedef struct replayer
+{
+  pthread_t thread;
+  op_t* ops;
+  int* turns;
+  int n_ops;
+  double seconds;
+} replayer_t;
+
+enum LAT_OP
+  {
+    LAT_MALLOC,
+    LAT_FREE,
+    NUMLATOPS
+  };
+
+typedef struct latency_hist
+{
+  long count;
+  unsigned long max;
+  long buckets[LATBUCKETS];
+} latency_hist_t;
+
+// one timed call of kma_malloc() or kma_free()
+typedef struct op_latency
+{
+  long index;
+  enum LAT_OP type;
+  int size;
+  unsigned long cycles;
+  int pagesTaken;
+  int pagesReleased;
+  int pagesInUse;
+} op_latency_t;
+
+// one page geometry replayed by --sweep
+typedef struct geometry
+{
+  long page_size;
+  long pool_size;
+  int colors;
+} geometry_t;
+
+// page sizes tried by --sweep when no --page-size list is given
+#define SWEEPPAGESIZES { 4096, 8192, 16384, 32768, 65536 }
+
+// longest list of sizes or colors on the command line
+#define MAXSIZES 16
+
+// the algorithm a binary is built for, which --alg overrides
+#if defined(KMA_DUMMY)
+#define DEFAULTALG &kma_dummy_ops
+#elif defined(KMA_RM)
+#define DEFAULTALG &kma_rm_ops
+#elif defined(KMA_P2FL)
+#define DEFAULTALG &kma_p2fl_ops
+#elif defined(KMA_MCK2)
+#define DEFAULTALG &kma_mck2_ops
+#elif defined(KMA_BUD)
+#define DEFAULTALG &kma_bud_ops
+#elif defined(KMA_LZBUD)
+#define DEFAULTALG &kma_lzbud_ops
+#else
+#define DEFAULTALG NULL
+#endif
+
 /************Global Variables*********************************************/
 
-static int val = 0;
+static char* backingNames[] = { "base pages", "hugetlb", "transparent huge pages" };
+
+static char* purposeNames[] = { "data", "metadata", "cache", "large" };
+
+static struct option options[] =
+  {
+    { "huge",      no_argument,       NULL, 'H' },
+    { "page-size", required_argument, NULL, 'p' },
+    { "pool-size", required_argument, NULL, 'P' },
+    { "colors",    required_argument, NULL, 'c' },
+    { "sweep",     no_argument,       NULL, 's' },
+    { "shared",    optional_argument, NULL, 'S' },
+    { "snapshot",  required_argument, NULL, 'w' },
+    { "restore",   required_argument, NULL, 'r' },
+    { "ops",       required_argument, NULL, 'n' },
+    { "convert",   required_argument, NULL, 'C' },
+    { "stream",    no_argument,       NULL, 'T' },
+    { "latency",   optional_argument, NULL, 'L' },
+    { "threads",   required_argument, NULL, 't' },
+    { "remote-frees", required_argument, NULL, 'f' },
+    { "alg",       required_argument, NULL, 'a' },
+    { "bench",     optional_argument, NULL, 'B' },
+    { "warmup",    required_argument, NULL, 'W' },
+    { "cpu",       required_argument, NULL, 'U' },
+    { "metrics",   required_argument, NULL, 'm' },
+    { "sample",    required_argument, NULL, 'i' },
+    { "decimate",  required_argument, NULL, 'd' },
+    { "purge",     required_argument, NULL, 'g' },
+    { "retain",    required_argument, NULL, 'R' },
+    { "release",   no_argument,       NULL, 'e' },
+    { "prezero",   required_argument, NULL, 'z' },
+    { "fork",      no_argument,       NULL, 'F' },
+    { NULL,        0,                 NULL, 0   }
+  };
 
 /************Function Prototypes******************************************/
-void allocate();
-void deallocate();
-void fill(char*, int);
-void check(char*, char*, int);
+void allocate(mem_t*, int, int);
+void deallocate(mem_t*, int);
+void fill(char*, int, int);
+void check(char*, int, int);
 void usage();
 void error(char*, char*);
 void pass();
 void fail();
+op_t* loadTrace(char*, int*);
+op_t* mapTrace(int, int*);
+void unloadTrace(op_t*, int);
+void convertTrace(op_t*, int, char*);
+void replay(op_t*, int, metrics_t*);
+void account(long, bool, metrics_t*);
+bool isStream(char*);
+FILE* openStream(char*, bool*);
+bool readOp(FILE*, bool, op_t*);
+void streamReplay(FILE*, bool, long, metrics_t*);
+live_t* findLive(live_table_t*, int);
+live_t* insertLive(live_table_t*, int);
+void removeLive(live_table_t*, live_t*);
+unsigned long readCycles();
+void startLatency();
+void recordLatency(op_latency_t*);
+void printLatency();
+void sweep(op_t*, int, geometry_t*, int);
+void threadSweep(op_t*, int, long*, int, double);
+void lockstep(op_t*, int, kma_ops_t**, int);
+int parseAlgs(char*, kma_ops_t**);
+void parsePurge(char*);
+void parseRetain(char*);
+void checkZeroed(int);
+void forkReplay(op_t*, int);
+void bench(op_t*, int, int, int, char*);
+unsigned long benchPass(op_t*, int, void**, int*, unsigned long*);
+void openMetrics(metrics_t*, enum METRICS_FORMAT, long, double);
+void addSample(metrics_t*, long, int, long);
+void closeMetrics(metrics_t*);
+void* writeMetrics(void*);
+void* replayThread(void*);
+int openMissCounter();
+long readMissCounter(int);
+void checkPages();
+int parseSizes(char*, long*);
 
 /************External Declaration*****************************************/
 
@@ -100,140 +386,2138 @@ int anyMismatches = 0;
 
 int currentAllocBytes = 0;
 
+// average ratio of wasted to used memory over the last replay
+double wasteRatio = 0.0;
+
+// sum of the ratios and the number of operations summed by the replay
+double ratioSum = 0.0;
+long ratioCount = 0;
+
 char *name = NULL;
 
+// number of request ids in the trace
+int n_req = 0;
+
+// pages in use per purpose when the replay starts, restored from a
+// snapshot
+int restoredPages = 0;
+int restoredTagged[NUMPURPOSES];
+
+// whether the replay stopped before the end of the trace
+bool partialReplay = FALSE;
+
+// the length of the binary trace the operations are mapped from, or 0
+long mappedLength = 0;
+
+// whether the replay records the latency of each operation, and how
+// many of the slowest it keeps
+bool measuring = FALSE;
+int numSlowest = DEFAULTSLOWEST;
+
+// whether kma_malloc() and kma_free() use the heap in the shared pool,
+// under its lock
+bool sharedHeap = FALSE;
+
+// whether allocate() and deallocate() time their call, which only
+// --latency and the side-by-side replay of several algorithms need
+bool timing = FALSE;
+
+// the last call of kma_malloc() or kma_free()
+op_latency_t lastCall;
+
+latency_hist_t latencies[NUMLATOPS][NUMSIZECLASSES + 1];
+
+// the slowest operations, a min-heap on their cycles
+op_latency_t* slowest = NULL;
+int n_slowest = 0;
+
+// pages requested and freed before the last operation
+int prevRequested, prevFreed;
+
+static char* latOpNames[] = { "malloc", "free" };
+
+static char* metricsNames[] = { "dat", "csv", "json" };
+static char* metricsFiles[] = { "kma_output.dat", "kma_output.csv", "kma_output.jsonl" };
+
+static char* metricsFields[] = { "op", "requested", "allocated", "waste_pct", "ops_per_s" };
+
+// operations between samples of the allocation output, and the change
+// that makes one when decimating
+long sampleInterval = 1;
+double decimate = 0.0;
+
+static kma_ops_t* algorithms[] =
+  {
+    &kma_dummy_ops,
+    &kma_rm_ops,
+    &kma_p2fl_ops,
+    &kma_mck2_ops,
+    &kma_bud_ops,
+    &kma_lzbud_ops,
+    NULL
+  };
+
+kma_ops_t* kma_alg = DEFAULTALG;
+
+// the state shared by the threads of a threaded replay: the heap and
+// its lock of every thread, and per request id the number of
+// operations done on it, its block and its size
+int numThreads;
+kma_heap_t** heaps;
+pthread_mutex_t* heapLocks;
+int* idTurns;
+void** idPtrs;
+int* idSizes;
+pthread_barrier_t startBarrier;
+
 int
 main(int argc, char* argv[])
 {
   
-  name = argv[0];
+  name = argv[0];
+  
+#ifdef COMPETITION
+  printf("%s: Running in competition mode\n", name);
+#endif
+
+#ifndef COMPETITION
+  printf("%s: Running in correctness mode\n", name);
+#endif
+
+  op_t* ops;
+  int n_ops;
+  long pageSizes[MAXSIZES], poolSizes[MAXSIZES], colors[MAXSIZES];
+  int n_pageSizes = 0, n_poolSizes = 0, n_colors = 0;
+  bool sweeping = FALSE;
+  bool sharing = FALSE;
+  char* sharedName = NULL;
+  char* snapshotFile = NULL;
+  char* restoreFile = NULL;
+  char* convertFile = NULL;
+  bool streaming = FALSE;
+  bool binaryStream = FALSE;
+  FILE* traceStream = NULL;
+  int maxOps = -1;
+  long threadCounts[MAXSIZES];
+  int n_threadCounts = 0;
+  double remoteFrees = 0.0;
+  kma_ops_t* algs[MAXSIZES];
+  int n_algs = 0;
+  int benchReps = 0;
+  int warmups = 1;
+  int cpu = -1;
+  bool releasing = FALSE;
+  int prezeroPages = 0;
+  bool forking = FALSE;
+  kma_page_stat_t* stat;
+  metrics_t* allocTrace = NULL;
+  enum METRICS_FORMAT metricsFormat = METRICS_DAT;
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "H", options, NULL)) != -1)
+    {
+      switch (opt)
+	{
+	case 'H':
+	  page_backing(BACKING_HUGETLB);
+	  break;
+	case 'p':
+	  n_pageSizes = parseSizes(optarg, pageSizes);
+	  break;
+	case 'P':
+	  n_poolSizes = parseSizes(optarg, poolSizes);
+	  break;
+	case 'c':
+	  n_colors = parseSizes(optarg, colors);
+	  break;
+	case 's':
+	  sweeping = TRUE;
+	  break;
+	case 'S':
+	  sharing = TRUE;
+	  sharedName = optarg;
+	  break;
+	case 'w':
+	  snapshotFile = optarg;
+	  break;
+	case 'r':
+	  restoreFile = optarg;
+	  break;
+	case 'n':
+	  maxOps = atoi(optarg);
+	  break;
+	case 'C':
+	  convertFile = optarg;
+	  break;
+	case 'T':
+	  streaming = TRUE;
+	  break;
+	case 't':
+	  n_threadCounts = parseSizes(optarg, threadCounts);
+	  break;
+	case 'f':
+	  remoteFrees = atof(optarg);
+	  break;
+	case 'a':
+	  n_algs = parseAlgs(optarg, algs);
+	  break;
+	case 'B':
+	  benchReps = (optarg != NULL) ? atoi(optarg) : DEFAULTREPS;
+	  break;
+	case 'W':
+	  warmups = atoi(optarg);
+	  break;
+	case 'U':
+	  cpu = atoi(optarg);
+	  break;
+	case 'm':
+	  for (metricsFormat = 0; metricsFormat <= METRICS_JSON; metricsFormat++)
+	    {
+	      if (strcmp(optarg, metricsNames[metricsFormat]) == 0)
+		{
+		  break;
+		}
+	    }
+	  if (metricsFormat > METRICS_JSON)
+	    {
+	      error("unknown metrics format", optarg);
+	    }
+	  break;
+	case 'i':
+	  sampleInterval = atol(optarg);
+	  break;
+	case 'd':
+	  decimate = atof(optarg);
+	  break;
+	case 'g':
+	  parsePurge(optarg);
+	  break;
+	case 'R':
+	  parseRetain(optarg);
+	  break;
+	case 'e':
+	  releasing = TRUE;
+	  break;
+	case 'F':
+	  forking = TRUE;
+	  break;
+	case 'z':
+	  prezeroPages = atoi(optarg);
+	  if (prezeroPages <= 0)
+	    {
+	      error("invalid number of pages to zero", optarg);
+	    }
+	  break;
+	case 'L':
+	  measuring = TRUE;
+	  if (optarg != NULL)
+	    {
+	      numSlowest = atoi(optarg);
+	    }
+	  break;
+	default:
+	  usage();
+	}
+    }
+  
+  if (optind != argc - 1)
+    {
+      usage();
+    }
+  
+  if (n_algs == 1)
+    {
+      kma_alg = algs[0];
+    }
+  else if (n_algs == 0 && kma_alg == NULL)
+    {
+      error("no algorithm selected", "use --alg");
+    }
+  
+  // several algorithms share one replay of a loaded trace
+  if (n_algs > 1
+      && (streaming || sweeping || n_pageSizes > 1 || n_poolSizes > 1 || n_colors > 1
+	  || n_threadCounts != 0 || snapshotFile != NULL || restoreFile != NULL
+	  || benchReps > 0))
+    {
+      error("several algorithms can only be replayed side by side", "");
+    }
+  
+  if (cpu >= 0)
+    {
+      cpu_set_t cpus;
+      
+      CPU_ZERO(&cpus);
+      CPU_SET(cpu, &cpus);
+      if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+	{
+	  error("unable to pin to the CPU", strerror(errno));
+	}
+    }
+  
+  // the two processes of a forked replay share the pool and its heap
+  if (forking)
+    {
+      if (streaming || isStream(argv[optind]) || sweeping || n_pageSizes > 1
+	  || n_poolSizes > 1 || n_colors > 1 || convertFile != NULL || n_algs > 1
+	  || n_threadCounts != 0 || benchReps > 0 || snapshotFile != NULL
+	  || restoreFile != NULL)
+	{
+	  error("a forked replay is a single replay of a loaded trace", "");
+	}
+      
+      sharing = TRUE;
+    }
+  
+  // a streamed trace is read as it is replayed, so it is replayed once
+  if (streaming || isStream(argv[optind]))
+    {
+      if (sweeping || n_pageSizes > 1 || n_poolSizes > 1 || n_colors > 1
+	  || convertFile != NULL || n_threadCounts != 0 || benchReps > 0)
+	{
+	  error("a streamed trace can only be replayed once", argv[optind]);
+	}
+      
+      traceStream = openStream(argv[optind], &binaryStream);
+      ops = NULL;
+      n_ops = 0;
+    }
+  else
+    {
+      ops = loadTrace(argv[optind], &n_ops);
+    }
+  
+  if (convertFile != NULL)
+    {
+      convertTrace(ops, n_ops, convertFile);
+      printf("Converted %d operations to %s\n", n_ops, convertFile);
+      unloadTrace(ops, n_ops);
+      pass();
+    }
+  
+  // the blocks of a partial replay stay allocated
+  if (maxOps >= 0 && maxOps < n_ops)
+    {
+      n_ops = maxOps;
+      partialReplay = TRUE;
+    }
+  
+  // several sizes can only be compared by a sweep
+  if (sweeping || n_pageSizes > 1 || n_poolSizes > 1 || n_colors > 1)
+    {
+      geometry_t* geometries;
+      int i, j, k, n = 0;
+      
+      if (n_pageSizes == 0)
+	{
+	  long defaults[] = SWEEPPAGESIZES;
+	  
+	  n_pageSizes = sizeof(defaults) / sizeof(defaults[0]);
+	  memcpy(pageSizes, defaults, sizeof(defaults));
+	}
+      
+      if (n_poolSizes == 0)
+	{
+	  poolSizes[n_poolSizes++] = 0;
+	}
+      
+      if (n_colors == 0)
+	{
+	  colors[n_colors++] = DEFAULTPAGECOLORS;
+	}
+      
+      geometries = malloc(n_pageSizes * n_poolSizes * n_colors * sizeof(geometry_t));
+      assert(geometries != NULL);
+      
+      for (i = 0; i < n_pageSizes; i++)
+	for (j = 0; j < n_poolSizes; j++)
+	  for (k = 0; k < n_colors; k++, n++)
+	    {
+	      geometries[n].page_size = pageSizes[i];
+	      geometries[n].pool_size = poolSizes[j];
+	      geometries[n].colors = colors[k];
+	    }
+      
+      // only a single replay is timed per operation
+      measuring = FALSE;
+      sweep(ops, n_ops, geometries, n);
+      free(geometries);
+      unloadTrace(ops, n_ops);
+      pass();
+    }
+  
+  if (n_pageSizes != 0 || n_poolSizes != 0)
+    {
+      page_geometry((n_pageSizes != 0) ? pageSizes[0] : DEFAULTPAGESIZE,
+		    (n_poolSizes != 0) ? poolSizes[0] : 0);
+    }
+  
+  if (n_colors != 0)
+    {
+      page_coloring(colors[0]);
+    }
+  
+  // a sweep changes the geometry, which a shared pool can not, so only
+  // a single replay shares it
+  if (sharing)
+    {
+      page_share(sharedName);
+      
+      // the default heap moves to the root of the segment, where the
+      // other processes find it; a new segment holds an empty one
+      kma_alg->default_heap = page_root(kma_alg->heap_size);
+      sharedHeap = TRUE;
+    }
+  
+  if (forking)
+    {
+      forkReplay(ops, n_ops);
+      unloadTrace(ops, n_ops);
+      checkPages();
+      pass();
+    }
+  
+  if (n_threadCounts != 0)
+    {
+      threadSweep(ops, n_ops, threadCounts, n_threadCounts, remoteFrees);
+      unloadTrace(ops, n_ops);
+      pass();
+    }
+  
+  if (n_algs > 1)
+    {
+      lockstep(ops, n_ops, algs, n_algs);
+      unloadTrace(ops, n_ops);
+      checkPages();
+      pass();
+    }
+  
+  if (benchReps > 0)
+    {
+      bench(ops, n_ops, benchReps, warmups, argv[optind]);
+      unloadTrace(ops, n_ops);
+      checkPages();
+      pass();
+    }
+  
+  // the restored blocks are not the trace's, they stay allocated
+  if (restoreFile != NULL)
+    {
+      kma_restore(restoreFile);
+      stat = page_stats();
+      restoredPages = stat->num_in_use;
+      memcpy(restoredTagged, stat->num_tagged, sizeof(restoredTagged));
+      printf("Restored %d pages in use from %s\n", restoredPages, restoreFile);
+    }
+  
+#ifndef COMPETITION
+  allocTrace = malloc(sizeof(metrics_t));
+  assert(allocTrace != NULL);
+  openMetrics(allocTrace, metricsFormat, sampleInterval, decimate);
+#endif
+
+  if (measuring)
+    {
+      startLatency();
+    }
+  
+  if (traceStream != NULL)
+    {
+      streamReplay(traceStream, binaryStream, maxOps, allocTrace);
+    }
+  else
+    {
+      replay(ops, n_ops, allocTrace);
+      unloadTrace(ops, n_ops);
+    }
+  
+  if (snapshotFile != NULL)
+    {
+      kma_snapshot(snapshotFile);
+      printf("Saved %d pages in use to %s\n", page_stats()->num_in_use,
+	     snapshotFile);
+    }
+
+#ifndef COMPETITION
+  closeMetrics(allocTrace);
+  free(allocTrace);
+#endif
+  
+  if (prezeroPages > 0)
+    {
+      checkZeroed(prezeroPages);
+    }
+  
+  if (releasing)
+    {
+      long resident = page_stats()->resident_bytes;
+      int released = page_release();
+      int purged = page_purge();
+      
+      printf("Released %d extents, purged %d pages, resident bytes %ld -> %ld\n",
+	     released, purged, resident, page_stats()->resident_bytes);
+    }
+  
+  stat = page_stats();
+  
+  printf("Page Requested/Freed/In Use: %5d/%5d/%5d\n",
+	 stat->num_requested, stat->num_freed, stat->num_in_use);	
+  printf("Page backing: %s\n", backingNames[stat->backing]);
+  printf("Extents Committed/Released/Rebuilds: %5d/%5d/%5d\n",
+	 stat->num_commits, stat->num_releases, stat->num_rebuilds);
+  printf("Extents %d, bytes Committed/Resident: %ld/%ld\n",
+	 stat->num_extents, stat->committed_bytes, stat->resident_bytes);
+  printf("Free pages Purged/Zeroed: %5d/%5d\n",
+	 stat->num_purged, stat->num_zeroed);
+  
+  int i;
+  for (i = 0; i < NUMPURPOSES; i++)
+    {
+      printf("Pages for %-8s In Use/Peak: %5d/%5d\n", purposeNames[i],
+	     stat->num_tagged[i], stat->max_tagged[i]);
+    }
+  
+  checkPages();
+  
+  if (measuring)
+    {
+      printLatency();
+    }
+
+#ifdef COMPETITION
+  printf("Competition average ratio: %f\n", wasteRatio);
+#endif
+  
+  pass();
+  return 0;
+}
+
+op_t*
+loadTrace(char* file, int* n_ops)
+{
+  FILE* f_test = fopen(file, "r");
+  if (f_test == NULL)
+    {
+      error("unable to open input test file", file);
+    }
+  
+  // a binary trace needs no parsing
+  char magic[sizeof(TRACEMAGIC) - 1];
+  if (fread(magic, 1, sizeof(magic), f_test) == sizeof(magic)
+      && memcmp(magic, TRACEMAGIC, sizeof(magic)) == 0)
+    {
+      op_t* ops = mapTrace(fileno(f_test), n_ops);
+      
+      fclose(f_test);
+      return ops;
+    }
+  rewind(f_test);
+  
+  // Get the number of requests in the trace file
+  int status = fscanf(f_test, "%d\n", &n_req);
+  if(status != 1)
+    error("Couldn't read number of requests at head of file", "");
+  
+  // every request is freed again, so expect two lines per request
+  int max_ops = 2 * n_req + 1;
+  op_t* ops = malloc(max_ops * sizeof(op_t));
+  int n = 0;
+  
+  char command[16];
+  int req_id, req_size;
+
+  // Parse the lines in the file into operations
+  while (fscanf(f_test, "%10s", command) == 1)
+    {
+      if (n == max_ops)
+	{
+	  max_ops *= 2;
+	  ops = realloc(ops, max_ops * sizeof(op_t));
+	}
+      assert(ops != NULL);
+      
+      if (strcmp(command, "REQUEST") == 0)
+	{
+	  if (fscanf(f_test, "%d %d", &req_id, &req_size) != 2)
+	    error("Not enough arguments to REQUEST", "");
+	  
+	  assert(req_size >= 0);
+	  ops[n].size = req_size;
+	}
+      else if (strcmp(command, "FREE") == 0)
+	{
+	  if (fscanf(f_test, "%d", &req_id) != 1)
+	    error("Not enough arguments to FREE", "");
+	  
+	  ops[n].size = FREESIZE;
+	}
+      else
+	{
+	  error("unknown command type:", command);
+	}
+      
+      assert(req_id >= 0 && req_id < n_req);
+      ops[n++].id = req_id;
+    }
+  
+  fclose(f_test);
+  
+  *n_ops = n;
+  return ops;
+}
+
+op_t*
+mapTrace(int fd, int* n_ops)
+{
+  trace_header_t* header;
+  struct stat st;
+  
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(trace_header_t))
+    {
+      error("Couldn't read the header of the binary trace", "");
+    }
+  
+  header = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (header == MAP_FAILED)
+    {
+      error("unable to map the binary trace", strerror(errno));
+    }
+  
+  if (header->n_ops < 0 || header->n_req < 0
+      || st.st_size < sizeof(trace_header_t) + (long) header->n_ops * sizeof(op_t))
+    {
+      error("Binary trace is truncated", "");
+    }
+  
+  // the replay reads it front to back, once; the advice values are
+  // not flags, so each takes its own call
+  if (madvise(header, st.st_size, MADV_SEQUENTIAL) != 0
+      || madvise(header, st.st_size, MADV_WILLNEED) != 0)
+    {
+      error("unable to advise on the binary trace", strerror(errno));
+    }
+  
+  n_req = header->n_req;
+  *n_ops = header->n_ops;
+  mappedLength = st.st_size;
+  return (op_t*) (header + 1);
+}
+
+void
+unloadTrace(op_t* ops, int n_ops)
+{
+  // --ops may have cut n_ops short, the whole file is mapped
+  if (mappedLength != 0)
+    {
+      munmap((trace_header_t*) ops - 1, mappedLength);
+      mappedLength = 0;
+    }
+  else
+    {
+      free(ops);
+    }
+}
+
+void
+convertTrace(op_t* ops, int n_ops, char* file)
+{
+  trace_header_t header;
+  FILE* f_out = fopen(file, "w");
+  
+  if (f_out == NULL)
+    {
+      error("unable to open binary trace file", file);
+    }
+  
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACEMAGIC, sizeof(header.magic));
+  header.n_ops = n_ops;
+  header.n_req = n_req;
+  
+  if (fwrite(&header, sizeof(header), 1, f_out) != 1
+      || fwrite(ops, sizeof(op_t), n_ops, f_out) != n_ops
+      || fclose(f_out) != 0)
+    {
+      error("unable to write binary trace file", file);
+    }
+}
+
+void
+replay(op_t* ops, int n_ops, metrics_t* allocTrace)
+{
+  int n_alloc = 0, n_dealloc = 0;
+  int i;
+  
+  ratioSum = 0.0;
+  ratioCount = 0;
+  
+  mem_t* requests = malloc((n_req + 1)*sizeof(mem_t));
+  memset(requests, 0, (n_req + 1)*sizeof(mem_t));
+  
+  // call allocate or deallocate for each operation of the trace
+  for (i = 0; i < n_ops; i++)
+    {
+      // ids of a binary trace are only checked here
+      assert(ops[i].id >= 0 && ops[i].id < n_req);
+      
+      if (ops[i].size != FREESIZE)
+	{
+	  allocate(&requests[ops[i].id], ops[i].id, ops[i].size);
+	  n_alloc++;
+	}
+      else
+	{
+	  deallocate(&requests[ops[i].id], ops[i].id);
+	  n_dealloc++;
+	}
+      
+      account(i, n_alloc != n_dealloc, allocTrace);
+    }
+  
+  free(requests);
+  
+  wasteRatio = ratioSum / ratioCount;
+}
+
+void
+account(long i, bool live, metrics_t* allocTrace)
+{
+  kma_page_stat_t* stat = page_stats();
+  long totalBytes = (long) (stat->num_in_use - restoredPages) * stat->page_size;
+  
+  if (measuring)
+    {
+      lastCall.index = i;
+      lastCall.pagesTaken = stat->num_requested - prevRequested;
+      lastCall.pagesReleased = stat->num_freed - prevFreed;
+      lastCall.pagesInUse = stat->num_in_use;
+      recordLatency(&lastCall);
+      
+      prevRequested = stat->num_requested;
+      prevFreed = stat->num_freed;
+    }
+  
+  if(live)
+    {
+      // We can calculate the ratio of wasted to used memory here.
+      
+      long wastedBytes = totalBytes - currentAllocBytes;
+      ratioSum += ((double) wastedBytes) / currentAllocBytes;
+      ratioCount += 1;
+    }
+  
+  if (allocTrace != NULL)
+    {
+      addSample(allocTrace, i + 1, currentAllocBytes, totalBytes);
+    }
+}
+
+bool
+isStream(char* file)
+{
+  struct stat st;
+  
+  return strcmp(file, "-") == 0
+    || (stat(file, &st) == 0 && S_ISFIFO(st.st_mode));
+}
+
+FILE*
+openStream(char* file, bool* binary)
+{
+  FILE* f_test = (strcmp(file, "-") == 0) ? stdin : fopen(file, "r");
+  trace_header_t header;
+  int c;
+  
+  if (f_test == NULL)
+    {
+      error("unable to open input test file", file);
+    }
+  setvbuf(f_test, NULL, _IOFBF, STREAMBUFSIZE);
+  
+  // a pipe can not be rewound, so the format is told by the first
+  // character, a digit for the count of a text trace
+  c = getc(f_test);
+  ungetc(c, f_test);
+  *binary = (c == TRACEMAGIC[0]);
+  
+  // the counts in the header are not needed, the ids live in a table
+  if (*binary)
+    {
+      if (fread(&header, sizeof(header), 1, f_test) != 1
+	  || memcmp(header.magic, TRACEMAGIC, sizeof(header.magic)) != 0)
+	{
+	  error("Couldn't read the header of the binary trace", file);
+	}
+    }
+  else if (fscanf(f_test, "%d\n", &n_req) != 1)
+    {
+      error("Couldn't read number of requests at head of file", "");
+    }
+  
+  return f_test;
+}
+
+bool
+readOp(FILE* f_test, bool binary, op_t* op)
+{
+  char command[16];
+  
+  if (binary)
+    {
+      return fread(op, sizeof(op_t), 1, f_test) == 1;
+    }
+  
+  if (fscanf(f_test, "%10s", command) != 1)
+    {
+      return FALSE;
+    }
+  
+  if (strcmp(command, "REQUEST") == 0)
+    {
+      if (fscanf(f_test, "%d %d", &op->id, &op->size) != 2)
+	error("Not enough arguments to REQUEST", "");
+      assert(op->size >= 0);
+    }
+  else if (strcmp(command, "FREE") == 0)
+    {
+      if (fscanf(f_test, "%d", &op->id) != 1)
+	error("Not enough arguments to FREE", "");
+      op->size = FREESIZE;
+    }
+  else
+    {
+      error("unknown command type:", command);
+    }
+  
+  return TRUE;
+}
+
+void
+streamReplay(FILE* f_test, bool binary, long maxOps, metrics_t* allocTrace)
+{
+  live_table_t table;
+  live_t* live;
+  op_t op;
+  long i;
+  
+  table.bits = 0;
+  while ((1L << table.bits) < MINLIVESLOTS)
+    {
+      table.bits++;
+    }
+  table.slots = malloc(MINLIVESLOTS * sizeof(live_t));
+  assert(table.slots != NULL);
+  for (i = 0; i < MINLIVESLOTS; i++)
+    {
+      table.slots[i].id = NOID;
+    }
+  table.count = 0;
+  
+  ratioSum = 0.0;
+  ratioCount = 0;
+  
+  // only the live requests are kept, so the memory of the harness does
+  // not grow with the trace
+  for (i = 0; i != maxOps && readOp(f_test, binary, &op); i++)
+    {
+      assert(op.id >= 0);
+      
+      if (op.size != FREESIZE)
+	{
+	  live = insertLive(&table, op.id);
+	  allocate(&live->mem, op.id, op.size);
+	}
+      else
+	{
+	  live = findLive(&table, op.id);
+	  if (live->id == NOID)
+	    {
+	      error("FREE of a request that is not allocated", "");
+	    }
+	  deallocate(&live->mem, op.id);
+	  removeLive(&table, live);
+	}
+      
+      account(i, table.count != 0, allocTrace);
+    }
+  
+  if (i == maxOps)
+    {
+      partialReplay = TRUE;
+    }
+  
+  if (f_test != stdin)
+    {
+      fclose(f_test);
+    }
+  free(table.slots);
+  
+  wasteRatio = ratioSum / ratioCount;
+}
+
+// the slot an id is looked up from
+static inline long
+homeSlot(live_table_t* table, int id)
+{
+  return (long) (((unsigned long) id * 0x9E3779B97F4A7C15UL) >> (64 - table->bits));
+}
+
+live_t*
+findLive(live_table_t* table, int id)
+{
+  long mask = (1L << table->bits) - 1;
+  long i = homeSlot(table, id);
+  
+  // linear probing, the table is never more than half full
+  while (table->slots[i].id != id && table->slots[i].id != NOID)
+    {
+      i = (i + 1) & mask;
+    }
+  
+  return &table->slots[i];
+}
+
+live_t*
+insertLive(live_table_t* table, int id)
+{
+  live_t* live;
+  
+  if (2 * (table->count + 1) > (1L << table->bits))
+    {
+      live_t* old = table->slots;
+      long n = 1L << table->bits;
+      long i;
+      
+      table->bits++;
+      table->slots = malloc((n << 1) * sizeof(live_t));
+      assert(table->slots != NULL);
+      for (i = 0; i < (n << 1); i++)
+	{
+	  table->slots[i].id = NOID;
+	}
+      
+      for (i = 0; i < n; i++)
+	{
+	  if (old[i].id != NOID)
+	    {
+	      *findLive(table, old[i].id) = old[i];
+	    }
+	}
+      free(old);
+    }
+  
+  live = findLive(table, id);
+  if (live->id != id)
+    {
+      live->id = id;
+      memset(&live->mem, 0, sizeof(mem_t));
+      table->count++;
+    }
+  
+  return live;
+}
+
+void
+removeLive(live_table_t* table, live_t* live)
+{
+  long mask = (1L << table->bits) - 1;
+  long i = live - table->slots;
+  long j = i;
+  long k;
+  
+  // shift the following entries of the run back, so lookups need no
+  // tombstones
+  for (;;)
+    {
+      j = (j + 1) & mask;
+      if (table->slots[j].id == NOID)
+	{
+	  break;
+	}
+      
+      // an entry moves unless its home slot lies cyclically in (i, j]
+      k = homeSlot(table, table->slots[j].id);
+      if ((i <= j) ? (k <= i || k > j) : (k <= i && k > j))
+	{
+	  table->slots[i] = table->slots[j];
+	  i = j;
+	}
+    }
+  
+  table->slots[i].id = NOID;
+  table->count--;
+}
+
+void
+sweep(op_t* ops, int n_ops, geometry_t* geometries, int n)
+{
+  struct timespec start, end;
+  long poolSize, misses;
+  char missText[32];
+  int counter = openMissCounter();
+  int i;
+  
+  for (i = 0; i < n; i++)
+    {
+      page_geometry(geometries[i].page_size, geometries[i].pool_size);
+      page_coloring(geometries[i].colors);
+      
+      if (counter >= 0)
+	{
+	  ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+	  ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+	}
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      replay(ops, n_ops, NULL);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      if (counter >= 0)
+	{
+	  ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+	}
+      
+      checkPages();
+      
+      misses = readMissCounter(counter);
+      if (misses < 0)
+	{
+	  strcpy(missText, "n/a");
+	}
+      else
+	{
+	  sprintf(missText, "%ld", misses);
+	}
+      
+      poolSize = (geometries[i].pool_size == 0)
+	? (long) MAXEXTENTS * EXTENTSIZE : geometries[i].pool_size;
+      printf("Page size %6ld, pool size %12ld, colors %2d: %10.3f ms, waste ratio %f, L1D misses %s\n",
+	     geometries[i].page_size, poolSize, geometries[i].colors,
+	     (end.tv_sec - start.tv_sec) * 1e3
+	     + (end.tv_nsec - start.tv_nsec) / 1e6,
+	     wasteRatio, missText);
+    }
+  
+  if (counter >= 0)
+    {
+      close(counter);
+    }
+}
+
+// a cheap, monotonic count of cycles, or nanoseconds where there is
+// no cycle counter
+inline unsigned long
+readCycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec now;
+  
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000UL + now.tv_nsec;
+#endif
+}
+
+static inline int
+latencyBucket(unsigned long cycles)
+{
+  int magnitude;
+  
+  if (cycles < LATSUB)
+    {
+      return (int) cycles;
+    }
+  
+  magnitude = 63 - __builtin_clzl(cycles);
+  return (magnitude - LATSUBBITS + 1) * LATSUB
+    + (int) (cycles >> (magnitude - LATSUBBITS)) - LATSUB;
+}
+
+// the largest latency counted in a bucket
+static unsigned long
+bucketTop(int bucket)
+{
+  int shift;
+  
+  if (bucket < LATSUB)
+    {
+      return bucket;
+    }
+  
+  shift = bucket / LATSUB - 1;
+  return ((unsigned long) (bucket % LATSUB + LATSUB + 1) << shift) - 1;
+}
+
+static int
+sizeClass(int size)
+{
+  int class = 0;
+  
+  while (class < NUMSIZECLASSES - 1 && size > (16 << class))
+    {
+      class++;
+    }
+  
+  return class;
+}
+
+void
+startLatency()
+{
+  kma_page_stat_t* stat = page_stats();
+  
+  memset(latencies, 0, sizeof(latencies));
+  
+  free(slowest);
+  slowest = malloc((numSlowest + 1) * sizeof(op_latency_t));
+  assert(slowest != NULL);
+  n_slowest = 0;
+  
+  prevRequested = stat->num_requested;
+  prevFreed = stat->num_freed;
+  timing = TRUE;
+}
+
+static void
+countLatency(latency_hist_t* hist, unsigned long cycles)
+{
+  hist->count++;
+  hist->buckets[latencyBucket(cycles)]++;
+  if (cycles > hist->max)
+    {
+      hist->max = cycles;
+    }
+}
+
+void
+recordLatency(op_latency_t* call)
+{
+  int i, child;
+  
+  countLatency(&latencies[call->type][ALLSIZES], call->cycles);
+  countLatency(&latencies[call->type][sizeClass(call->size)], call->cycles);
+  
+  if (n_slowest < numSlowest)
+    {
+      // sift the new operation up
+      for (i = n_slowest++; i > 0 && slowest[(i - 1) / 2].cycles > call->cycles;
+	   i = (i - 1) / 2)
+	{
+	  slowest[i] = slowest[(i - 1) / 2];
+	}
+      slowest[i] = *call;
+    }
+  else if (n_slowest > 0 && call->cycles > slowest[0].cycles)
+    {
+      // replace the fastest of the slowest and sift it down
+      for (i = 0; (child = 2 * i + 1) < n_slowest; i = child)
+	{
+	  if (child + 1 < n_slowest && slowest[child + 1].cycles < slowest[child].cycles)
+	    {
+	      child++;
+	    }
+	  if (slowest[child].cycles >= call->cycles)
+	    {
+	      break;
+	    }
+	  slowest[i] = slowest[child];
+	}
+      slowest[i] = *call;
+    }
+}
+
+// the latency below which a fraction q of the operations fall
+static unsigned long
+percentile(latency_hist_t* hist, double q)
+{
+  long rank = (long) (q * hist->count + 0.5);
+  long seen = 0;
+  int i;
+  
+  if (rank < 1)
+    {
+      rank = 1;
+    }
+  
+  for (i = 0; i < LATBUCKETS; i++)
+    {
+      seen += hist->buckets[i];
+      if (seen >= rank)
+	{
+	  // no bucket reports more than the largest latency seen
+	  return (bucketTop(i) < hist->max) ? bucketTop(i) : hist->max;
+	}
+    }
+  
+  return hist->max;
+}
+
+static int
+bySlowest(const void* a, const void* b)
+{
+  unsigned long x = ((op_latency_t*) a)->cycles;
+  unsigned long y = ((op_latency_t*) b)->cycles;
+  
+  return (x < y) - (x > y);
+}
+
+void
+printLatency()
+{
+  char sizeText[32];
+  latency_hist_t* hist;
+  int type, class, i;
+  
+  printf("Latency (cycles)          Count        p50        p99      p99.9        max\n");
+  for (type = 0; type < NUMLATOPS; type++)
+    {
+      // all sizes first, then from the smallest up
+      for (i = -1; i < NUMSIZECLASSES; i++)
+	{
+	  class = (i < 0) ? ALLSIZES : i;
+	  hist = &latencies[type][class];
+	  if (hist->count == 0)
+	    {
+	      continue;
+	    }
+	  
+	  if (class == ALLSIZES)
+	    {
+	      strcpy(sizeText, "");
+	    }
+	  else if (class == NUMSIZECLASSES - 1)
+	    {
+	      sprintf(sizeText, "> %d", 16 << (class - 1));
+	    }
+	  else
+	    {
+	      sprintf(sizeText, "<= %d", 16 << class);
+	    }
+	  
+	  printf("%-6s %-10s %12ld %10lu %10lu %10lu %10lu\n",
+		 latOpNames[type], sizeText, hist->count,
+		 percentile(hist, 0.5), percentile(hist, 0.99),
+		 percentile(hist, 0.999), hist->max);
+	}
+    }
+  
+  qsort(slowest, n_slowest, sizeof(op_latency_t), bySlowest);
+  printf("Slowest operations    Index  Op          Size     Cycles  Pages Taken/Released/In Use\n");
+  for (i = 0; i < n_slowest; i++)
+    {
+      printf("%18d %8ld  %-6s %9d %10lu  %5d/%5d/%5d\n", i + 1,
+	     slowest[i].index, latOpNames[slowest[i].type], slowest[i].size,
+	     slowest[i].cycles, slowest[i].pagesTaken,
+	     slowest[i].pagesReleased, slowest[i].pagesInUse);
+    }
+}
+
+void
+threadSweep(op_t* ops, int n_ops, long* counts, int n, double remoteFrees)
+{
+  struct timespec start, end;
+  replayer_t* replayers;
+  int* ordinals;
+  double seconds;
+  int c, i, t, owner;
+  
+  ordinals = malloc(n_req * sizeof(int));
+  idTurns = malloc(n_req * sizeof(int));
+  idPtrs = malloc(n_req * sizeof(void*));
+  idSizes = malloc(n_req * sizeof(int));
+  assert(ordinals != NULL && idTurns != NULL && idPtrs != NULL && idSizes != NULL);
+  
+  for (c = 0; c < n; c++)
+    {
+      numThreads = counts[c];
+      if (numThreads < 1)
+	{
+	  error("the number of threads must be positive", "");
+	}
+      
+      replayers = calloc(numThreads, sizeof(replayer_t));
+      heaps = malloc(numThreads * sizeof(kma_heap_t*));
+      heapLocks = malloc(numThreads * sizeof(pthread_mutex_t));
+      assert(replayers != NULL && heaps != NULL && heapLocks != NULL);
+      
+      // the ids are spread over the threads; the thread after the owner
+      // does the remote frees, chosen by a hash of the id
+      for (i = 0; i < n_ops; i++)
+	{
+	  owner = ops[i].id % numThreads;
+	  if (ops[i].size == FREESIZE
+	      && (unsigned int) ops[i].id * 2654435761U < remoteFrees * 4294967296.0)
+	    {
+	      owner = (owner + 1) % numThreads;
+	    }
+	  replayers[owner].n_ops++;
+	}
+      
+      for (t = 0; t < numThreads; t++)
+	{
+	  replayers[t].ops = malloc(replayers[t].n_ops * sizeof(op_t) + 1);
+	  replayers[t].turns = malloc(replayers[t].n_ops * sizeof(int) + 1);
+	  assert(replayers[t].ops != NULL && replayers[t].turns != NULL);
+	  replayers[t].n_ops = 0;
+	  
+	  heaps[t] = kma_heap_create();
+	  pthread_mutex_init(&heapLocks[t], NULL);
+	}
+      
+      memset(ordinals, 0, n_req * sizeof(int));
+      memset(idTurns, 0, n_req * sizeof(int));
+      for (i = 0; i < n_ops; i++)
+	{
+	  owner = ops[i].id % numThreads;
+	  if (ops[i].size == FREESIZE
+	      && (unsigned int) ops[i].id * 2654435761U < remoteFrees * 4294967296.0)
+	    {
+	      owner = (owner + 1) % numThreads;
+	    }
+	  replayers[owner].ops[replayers[owner].n_ops] = ops[i];
+	  replayers[owner].turns[replayers[owner].n_ops++] = ordinals[ops[i].id]++;
+	}
+      
+      pthread_barrier_init(&startBarrier, NULL, numThreads + 1);
+      for (t = 0; t < numThreads; t++)
+	{
+	  if (pthread_create(&replayers[t].thread, NULL, replayThread, &replayers[t]) != 0)
+	    {
+	      error("unable to start a replay thread", "");
+	    }
+	}
+      
+      pthread_barrier_wait(&startBarrier);
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      for (t = 0; t < numThreads; t++)
+	{
+	  pthread_join(replayers[t].thread, NULL);
+	}
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      pthread_barrier_destroy(&startBarrier);
+      
+      seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+      printf("Threads %3d, remote frees %5.1f%%: %10.3f ms, %12.0f ops/s, per thread",
+	     numThreads, remoteFrees * 100, seconds * 1e3, n_ops / seconds);
+      for (t = 0; t < numThreads; t++)
+	{
+	  printf(" %.0f", replayers[t].n_ops / replayers[t].seconds);
+	}
+      printf("\n");
+      
+      // a partial replay leaves blocks, which go with their heaps
+      for (t = 0; t < numThreads; t++)
+	{
+	  kma_heap_destroy(heaps[t]);
+	  pthread_mutex_destroy(&heapLocks[t]);
+	  free(replayers[t].ops);
+	  free(replayers[t].turns);
+	}
+      free(replayers);
+      free(heaps);
+      free(heapLocks);
+      
+      partialReplay = FALSE;
+      checkPages();
+    }
+  
+  free(ordinals);
+  free(idTurns);
+  free(idPtrs);
+  free(idSizes);
+}
+
+void
+lockstep(op_t* ops, int n_ops, kma_ops_t** algs, int n)
+{
+  mem_t* requests[MAXSIZES];
+  int allocBytes[MAXSIZES];
+  int peakPages[MAXSIZES];
+  unsigned long cycles[MAXSIZES];
+  double ratioSums[MAXSIZES];
+  long live = 0;
+  int pages, i, a;
+  
+  for (a = 0; a < n; a++)
+    {
+      requests[a] = calloc(n_req + 1, sizeof(mem_t));
+      assert(requests[a] != NULL);
+      allocBytes[a] = 0;
+      peakPages[a] = 0;
+      cycles[a] = 0;
+      ratioSums[a] = 0.0;
+    }
+  ratioCount = 0;
+  timing = TRUE;
+  
+  // every operation goes to all algorithms before the next one, so
+  // they see the trace with the same cache state; the pool is shared,
+  // so each counts the pages of its own heap
+  for (i = 0; i < n_ops; i++)
+    {
+      live += (ops[i].size != FREESIZE) ? 1 : -1;
+      
+      for (a = 0; a < n; a++)
+	{
+	  kma_alg = algs[a];
+	  currentAllocBytes = allocBytes[a];
+	  
+	  if (ops[i].size != FREESIZE)
+	    {
+	      allocate(&requests[a][ops[i].id], ops[i].id, ops[i].size);
+	    }
+	  else
+	    {
+	      deallocate(&requests[a][ops[i].id], ops[i].id);
+	    }
+	  
+	  allocBytes[a] = currentAllocBytes;
+	  cycles[a] += lastCall.cycles;
+	  
+	  pages = kma_alg->heap_pages(kma_alg->default_heap);
+	  if (pages > peakPages[a])
+	    {
+	      peakPages[a] = pages;
+	    }
+	  if (live != 0)
+	    {
+	      ratioSums[a] += ((double) pages * PAGESIZE - allocBytes[a]) / allocBytes[a];
+	    }
+	}
+      
+      if (live != 0)
+	{
+	  ratioCount++;
+	}
+    }
+  
+  for (a = 0; a < n; a++)
+    {
+      printf("Algorithm %-6s: %12lu cycles, %8.1f cycles/op, waste ratio %f, peak pages %5d\n",
+	     algs[a]->name, cycles[a], (double) cycles[a] / n_ops,
+	     ratioSums[a] / ratioCount, peakPages[a]);
+      free(requests[a]);
+    }
+}
+
+static int
+byValue(const void* a, const void* b)
+{
+  double x = *(double*) a;
+  double y = *(double*) b;
+  
+  return (x > y) - (x < y);
+}
+
+// the median of n sorted values
+static double
+median(double* values, int n)
+{
+  return (n % 2) ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+void
+bench(op_t* ops, int n_ops, int reps, int warmups, char* trace)
+{
+  double tQuantiles[] = TQUANTILES;
+  struct timespec start, end;
+  unsigned long cycles;
+  double* nsPerOp = malloc(reps * sizeof(double));
+  double* cyclesPerOp = malloc(reps * sizeof(double));
+  void** ptrs = malloc((n_req + 1) * sizeof(void*));
+  int* sizes = malloc((n_req + 1) * sizeof(int));
+  double mean = 0.0, variance = 0.0, t;
+  int i;
+  
+  assert(nsPerOp != NULL && cyclesPerOp != NULL && ptrs != NULL && sizes != NULL);
+  
+  // the first warm-up pass is the checked replay, which measures the
+  // waste ratio
+  replay(ops, n_ops, NULL);
+  for (i = 1; i < warmups; i++)
+    {
+      benchPass(ops, n_ops, ptrs, sizes, &cycles);
+    }
+  
+  for (i = 0; i < reps; i++)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      benchPass(ops, n_ops, ptrs, sizes, &cycles);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      
+      nsPerOp[i] = ((end.tv_sec - start.tv_sec) * 1e9
+		    + (end.tv_nsec - start.tv_nsec)) / n_ops;
+      cyclesPerOp[i] = (double) cycles / n_ops;
+      mean += nsPerOp[i] / reps;
+    }
+  
+  for (i = 0; i < reps; i++)
+    {
+      variance += (nsPerOp[i] - mean) * (nsPerOp[i] - mean);
+    }
+  variance = (reps > 1) ? variance / (reps - 1) : 0.0;
+  t = (reps - 1 <= sizeof(tQuantiles) / sizeof(tQuantiles[0]))
+    ? tQuantiles[(reps > 1) ? reps - 2 : 0] : NORMALQUANTILE;
+  
+  qsort(nsPerOp, reps, sizeof(double), byValue);
+  qsort(cyclesPerOp, reps, sizeof(double), byValue);
+  
+  printf("bench alg=%s trace=%s ops=%d warmup=%d reps=%d"
+	 " ns_op_median=%.2f ns_op_mean=%.2f ns_op_ci95=%.2f"
+	 " cycles_op_median=%.1f waste_ratio=%f\n",
+	 kma_alg->name, trace, n_ops, warmups, reps,
+	 median(nsPerOp, reps), mean, t * sqrt(variance / reps),
+	 median(cyclesPerOp, reps), wasteRatio);
+  
+  free(nsPerOp);
+  free(cyclesPerOp);
+  free(ptrs);
+  free(sizes);
+}
+
+// replays the trace on a fresh heap, without checks or accounting,
+// and destroys the heap, so that every pass starts from the same state
+unsigned long
+benchPass(op_t* ops, int n_ops, void** ptrs, int* sizes, unsigned long* cycles)
+{
+  kma_heap_t* heap = kma_heap_create();
+  int i;
+  
+  *cycles = readCycles();
+  for (i = 0; i < n_ops; i++)
+    {
+      if (ops[i].size != FREESIZE)
+	{
+	  sizes[ops[i].id] = ops[i].size;
+	  ptrs[ops[i].id] = kma_heap_malloc(heap, ops[i].size);
+	}
+      else if (ptrs[ops[i].id] != NULL)
+	{
+	  kma_heap_free(heap, ptrs[ops[i].id], sizes[ops[i].id]);
+	}
+    }
+  *cycles = readCycles() - *cycles;
+  
+  kma_heap_destroy(heap);
+  return *cycles;
+}
+
+void
+openMetrics(metrics_t* metrics, enum METRICS_FORMAT format, long interval,
+	    double decimate)
+{
+  metrics->out = fopen(metricsFiles[format], "w");
+  if (metrics->out == NULL)
+    {
+      error("unable to open allocation output file", metricsFiles[format]);
+    }
+  
+  metrics->format = format;
+  metrics->interval = (interval > 0) ? interval : 1;
+  metrics->decimate = decimate;
+  memset(metrics->fill, 0, sizeof(metrics->fill));
+  metrics->produced = 0;
+  metrics->written = 0;
+  metrics->closing = FALSE;
+  pthread_mutex_init(&metrics->lock, NULL);
+  pthread_cond_init(&metrics->changed, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &metrics->start);
+  
+  if (format == METRICS_CSV)
+    {
+      fprintf(metrics->out, "%s,%s,%s,%s,%s\n", metricsFields[0], metricsFields[1],
+	      metricsFields[2], metricsFields[3], metricsFields[4]);
+    }
+  
+  if (pthread_create(&metrics->writer, NULL, writeMetrics, metrics) != 0)
+    {
+      error("unable to start the allocation output writer", "");
+    }
+  
+  // the output starts from the empty heap
+  metrics->taken.op = -1;
+  addSample(metrics, 0, 0, 0);
+}
+
+// whether a value moved by more than a fraction from where it was
+static inline bool
+movedBy(long from, long to, double fraction)
+{
+  return (to > from) ? (to - from > fraction * from) : (from - to > fraction * from);
+}
+
+void
+addSample(metrics_t* metrics, long op, int requested, long allocated)
+{
+  struct timespec now;
+  sample_t* sample = &metrics->latest;
+  int block;
+  
+  sample->op = op;
+  sample->requested = requested;
+  sample->allocated = allocated;
+  
+  // every interval-th operation is a sample; with decimation, only
+  // if the heap changed enough since the last sample
+  if (metrics->taken.op >= 0
+      && (op - metrics->taken.op < metrics->interval
+	  || (metrics->decimate > 0.0
+	      && !movedBy(metrics->taken.requested, requested, metrics->decimate)
+	      && !movedBy(metrics->taken.allocated, allocated, metrics->decimate))))
+    {
+      return;
+    }
+  
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  sample->ns = (now.tv_sec - metrics->start.tv_sec) * 1000000000L
+    + (now.tv_nsec - metrics->start.tv_nsec);
+  metrics->taken = *sample;
+  
+  block = metrics->produced % NUMSAMPLEBLOCKS;
+  metrics->blocks[block][metrics->fill[block]++] = *sample;
+  if (metrics->fill[block] < SAMPLEBLOCK)
+    {
+      return;
+    }
+  
+  // hand the block over, and wait for the writer to free the next
+  pthread_mutex_lock(&metrics->lock);
+  metrics->produced++;
+  pthread_cond_broadcast(&metrics->changed);
+  while (metrics->produced - metrics->written >= NUMSAMPLEBLOCKS)
+    {
+      pthread_cond_wait(&metrics->changed, &metrics->lock);
+    }
+  metrics->fill[metrics->produced % NUMSAMPLEBLOCKS] = 0;
+  pthread_mutex_unlock(&metrics->lock);
+}
+
+void
+closeMetrics(metrics_t* metrics)
+{
+  // the last operation is always in the output
+  if (metrics->latest.op != metrics->taken.op)
+    {
+      metrics->interval = 0;
+      metrics->decimate = 0.0;
+      addSample(metrics, metrics->latest.op, metrics->latest.requested,
+		metrics->latest.allocated);
+    }
+  
+  pthread_mutex_lock(&metrics->lock);
+  if (metrics->fill[metrics->produced % NUMSAMPLEBLOCKS] > 0)
+    {
+      metrics->produced++;
+    }
+  metrics->closing = TRUE;
+  pthread_cond_broadcast(&metrics->changed);
+  pthread_mutex_unlock(&metrics->lock);
+  
+  pthread_join(metrics->writer, NULL);
+  pthread_cond_destroy(&metrics->changed);
+  pthread_mutex_destroy(&metrics->lock);
+  fclose(metrics->out);
+}
+
+// appends a number, with two decimals if fixed, without the cost of
+// printf's parsing and floating point
+static char*
+appendNumber(char* p, long value, bool fixed)
+{
+  char digits[24];
+  int n = 0;
+  
+  if (value < 0)
+    {
+      *p++ = '-';
+      value = -value;
+    }
+  
+  do
+    {
+      digits[n++] = '0' + value % 10;
+      value /= 10;
+    }
+  while (value > 0 || (fixed && n < 3));
+  
+  while (n > 0)
+    {
+      if (fixed && n == 2)
+	{
+	  *p++ = '.';
+	}
+      *p++ = digits[--n];
+    }
+  
+  return p;
+}
+
+void*
+writeMetrics(void* arg)
+{
+  metrics_t* metrics = (metrics_t*) arg;
+  sample_t previous = { 0, 0, 0, 0 };
+  sample_t* sample;
+  long values[5];
+  char* lines = malloc(SAMPLEBLOCK * MAXSAMPLELINE);
+  char* p;
+  int block, n, i, f;
+  
+  assert(lines != NULL);
+  
+  pthread_mutex_lock(&metrics->lock);
+  for (;;)
+    {
+      while (metrics->written == metrics->produced && !metrics->closing)
+	{
+	  pthread_cond_wait(&metrics->changed, &metrics->lock);
+	}
+      if (metrics->written == metrics->produced)
+	{
+	  break;
+	}
+      
+      block = metrics->written % NUMSAMPLEBLOCKS;
+      n = metrics->fill[block];
+      pthread_mutex_unlock(&metrics->lock);
+      
+      // the replay does not touch a block until it is written
+      for (i = 0, p = lines; i < n; i++)
+	{
+	  sample = &metrics->blocks[block][i];
+	  values[0] = sample->op;
+	  values[1] = sample->requested;
+	  values[2] = sample->allocated;
+	  // in hundredths of a percent
+	  values[3] = (sample->allocated > 0)
+	    ? 10000 * (sample->allocated - sample->requested) / sample->allocated : 0;
+	  values[4] = (sample->ns > previous.ns)
+	    ? (long) ((double) (sample->op - previous.op) * 1e9 / (sample->ns - previous.ns)) : 0;
+	  previous = *sample;
+	  
+	  for (f = 0; f < 5; f++)
+	    {
+	      if (metrics->format == METRICS_JSON)
+		{
+		  p = stpcpy(p, (f == 0) ? "{\"" : ",\"");
+		  p = stpcpy(p, metricsFields[f]);
+		  p = stpcpy(p, "\":");
+		}
+	      else if (f > 0)
+		{
+		  *p++ = (metrics->format == METRICS_CSV) ? ',' : ' ';
+		}
+	      p = appendNumber(p, values[f], f == 3);
+	    }
+	  if (metrics->format == METRICS_JSON)
+	    {
+	      *p++ = '}';
+	    }
+	  *p++ = '\n';
+	}
+      fwrite(lines, 1, p - lines, metrics->out);
+      
+      pthread_mutex_lock(&metrics->lock);
+      metrics->written++;
+      pthread_cond_broadcast(&metrics->changed);
+    }
+  pthread_mutex_unlock(&metrics->lock);
+  
+  free(lines);
+  return NULL;
+}
+
+void
+parsePurge(char* arg)
+{
+  kma_purge_policy_t policy;
+  int idlePages = PURGEIDLEPAGES;
+  char* lazy = strchr(arg, ',');
+  
+  // immediate, idle[:PAGES] or explicit, then optionally ,lazy
+  if (lazy != NULL && strcmp(lazy, ",lazy") != 0)
+    {
+      error("unknown purge option", lazy + 1);
+    }
   
-#ifdef COMPETITION
-  printf("%s: Running in competition mode\n", name);
-#endif
-
-#ifndef COMPETITION
-  printf("%s: Running in correctness mode\n", name);
-#endif
-
-  int n_req = 0, n_alloc=0, n_dealloc=0;
-  kma_page_stat_t* stat;
-
-#ifdef COMPETITION
-  double ratioSum = 0.0;
-  int ratioCount = 0;
-#endif
+  if (strncmp(arg, "immediate", strlen("immediate")) == 0)
+    {
+      policy = PURGE_IMMEDIATE;
+    }
+  else if (strncmp(arg, "explicit", strlen("explicit")) == 0)
+    {
+      policy = PURGE_EXPLICIT;
+    }
+  else if (strncmp(arg, "idle", strlen("idle")) == 0)
+    {
+      policy = PURGE_IDLE;
+      if (arg[strlen("idle")] == ':')
+	{
+	  idlePages = atoi(arg + strlen("idle") + 1);
+	}
+    }
+  else
+    {
+      error("unknown purge policy", arg);
+      return;
+    }
   
-#ifndef COMPETITION
-  FILE* allocTrace = fopen("kma_output.dat", "w");
-  if (allocTrace == NULL)
+  if (idlePages < 0)
     {
-      error("unable to open allocation output file", "kma_output.dat");
+      error("invalid number of idle pages", arg);
     }
-  fprintf(allocTrace, "0 0 0\n");
-#endif
+  
+  page_purge_policy(policy, idlePages, lazy != NULL);
+}
 
-  if (argc != 2)
+void
+parseRetain(char* arg)
+{
+  char* end;
+  long pages = strtol(arg, &end, 10);
+  long idleMs = RETAINIDLEMS;
+  
+  // PAGES[,MS]
+  if (*end == ',')
     {
-      usage();
+      idleMs = strtol(end + 1, &end, 10);
     }
   
-  FILE* f_test = fopen(argv[1], "r");
-  if (f_test == NULL)
+  if (*end != '\0' || end == arg || pages < 0 || idleMs < 0)
     {
-      error("unable to open input test file", argv[1]);
+      error("invalid retention policy", arg);
     }
   
-  // Get the number of requests in the trace file
-  // Allocate some memory...
-  int status = fscanf(f_test, "%d\n", &n_req);
-  if(status != 1)
-    error("Couldn't read number of requests at head of file", "");
+  page_retain_policy(pages, idleMs);
+}
+
+void
+forkReplay(op_t* ops, int n_ops)
+{
+  long size = sizeof(fork_table_t) + n_req * sizeof(mem_t);
+  fork_table_t* table;
+  pid_t parent = getpid();
+  pid_t child;
+  int status, i;
   
-  mem_t* requests = malloc((n_req + 1)*sizeof(mem_t));
-  memset(requests, 0, (n_req + 1)*sizeof(mem_t));
+  // the mapping is zero, so every request starts out FREE
+  table = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (table == MAP_FAILED)
+    {
+      error("Error using mmap to share the requests", "");
+    }
   
-  char command[16];
-  int req_id, req_size, index = 1;
-
-  // Parse the lines in the file, and call allocate or
-  // deallocate accordingly.
-  while (fscanf(f_test, "%10s", command) == 1)
+  // what is buffered would be written by both processes
+  fflush(stdout);
+  
+  child = fork();
+  if (child < 0)
     {
-      if (strcmp(command, "REQUEST") == 0)
+      error("unable to fork", strerror(errno));
+    }
+  
+  // the parent does the even operations and the child the odd ones, so
+  // a block is as often freed and checked by the other process as by
+  // the one that allocated and filled it
+  for (i = (child == 0) ? 1 : 0; i < n_ops; i += 2)
+    {
+      while (__atomic_load_n(&table->next, __ATOMIC_ACQUIRE) != i)
 	{
+	  if ((child == 0) ? getppid() != parent : waitpid(child, &status, WNOHANG) != 0)
+	    {
+	      error("the other process of the forked replay is gone", "");
+	    }
 	  
-	  if (fscanf(f_test, "%d %d", &req_id, &req_size) != 2)
-	    error("Not enough arguments to REQUEST", "");
-
-	  assert(req_id >= 0 && req_id < n_req);
-	  
-	  allocate(requests, req_id, req_size);
-	  n_alloc++;
+	  sched_yield();
 	}
-      else if (strcmp(command, "FREE") == 0)
+      
+      assert(ops[i].id >= 0 && ops[i].id < n_req);
+      
+      if (ops[i].size != FREESIZE)
 	{
-	  if (fscanf(f_test, "%d", &req_id) != 1)
-	    error("Not enough arguments to FREE", "");
-	  
-	  assert(req_id >= 0 && req_id < n_req);
-	  
-	  deallocate(requests, req_id);
-	  n_dealloc++;
+	  allocate(&table->requests[ops[i].id], ops[i].id, ops[i].size);
 	}
       else
 	{
-	  error("unknown command type:", command);
+	  deallocate(&table->requests[ops[i].id], ops[i].id);
 	}
+      
+      __atomic_store_n(&table->next, i + 1, __ATOMIC_RELEASE);
+    }
+  
+  if (child == 0)
+    {
+      _exit(anyMismatches ? 1 : 0);
+    }
+  
+  if (waitpid(child, &status, 0) != child || !WIFEXITED(status)
+      || WEXITSTATUS(status) != 0)
+    {
+      error("the child of the forked replay failed", "");
+    }
+  
+  printf("Forked replay: %d operations taking turns in two processes\n", n_ops);
+  
+  munmap(table, size);
+}
 
-      stat = page_stats();
-      int totalBytes = stat->num_in_use * stat->page_size;
+void
+checkZeroed(int count)
+{
+  kma_page_t** pages = malloc(count * sizeof(kma_page_t*));
+  int zeroed, queued;
+  long* word;
+  int i;
+  
+  assert(pages != NULL);
+  
+  zeroed = page_prezero(count);
+  queued = page_stats()->num_zeroed;
+  
+  // the prezeroed pages are handed out first, the rest are cleared on
+  // the spot; both must read back as zero
+  for (i = 0; i < count; i++)
+    {
+      pages[i] = get_zeroed_page(PAGE_DATA);
+      
+      for (word = pages[i]->ptr; (void*) word < pages[i]->ptr + PAGESIZE; word++)
+	{
+	  if (*word != 0)
+	    {
+	      error("a zeroed page does not read back as zero", "");
+	    }
+	}
+      
+      // dirty it, so it is not mistaken for zero once it is freed
+      memset(pages[i]->ptr, 0xa5, PAGESIZE);
+    }
+  
+  printf("Prezeroed %d pages, %d queued, %d zeroed pages read back as zero\n",
+	 zeroed, queued, count);
+  
+  for (i = 0; i < count; i++)
+    {
+      free_page(pages[i]);
+    }
+  free(pages);
+}
 
+int
+parseAlgs(char* arg, kma_ops_t** algs)
+{
+  int n = 0;
+  char* end;
+  int i, j, length;
+  
+  // a comma separated list of algorithm names
+  do
+    {
+      end = strchrnul(arg, ',');
+      length = end - arg;
       
-#ifdef COMPETITION
-      if(req_id < n_req && n_alloc != n_dealloc)
+      for (i = 0; algorithms[i] != NULL; i++)
+	{
+	  if (strlen(algorithms[i]->name) == length
+	      && strncmp(algorithms[i]->name, arg, length) == 0)
+	    {
+	      break;
+	    }
+	}
+      
+      if (algorithms[i] == NULL)
+	{
+	  error("unknown algorithm", arg);
+	}
+      if (n == MAXSIZES)
+	{
+	  error("too many algorithms", arg);
+	}
+      
+      // an algorithm has one default heap
+      for (j = 0; j < n; j++)
 	{
-	  // We can calculate the ratio of wasted to used memory here.
+	  if (algs[j] == algorithms[i])
+	    {
+	      error("algorithm listed twice", arg);
+	    }
+	}
+      
+      algs[n++] = algorithms[i];
+      arg = end + 1;
+    }
+  while (*end == ',');
+  
+  return n;
+}
 
-	  int wastedBytes = totalBytes - currentAllocBytes;
-	  ratioSum += ((double) wastedBytes) / currentAllocBytes;
-	  ratioCount += 1;
+void*
+replayThread(void* arg)
+{
+  replayer_t* self = (replayer_t*) arg;
+  struct timespec start, end;
+  op_t* op;
+  void* ptr;
+  int i, owner;
+  
+  pthread_barrier_wait(&startBarrier);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  
+  for (i = 0; i < self->n_ops; i++)
+    {
+      op = &self->ops[i];
+      owner = op->id % numThreads;
+      
+      // the operations on an id are done in trace order; a thread only
+      // waits for operations before its own, so the threads never wait
+      // for each other in a cycle
+      while (__atomic_load_n(&idTurns[op->id], __ATOMIC_ACQUIRE) != self->turns[i])
+	{
+	  sched_yield();
 	}
+      
+      if (op->size != FREESIZE)
+	{
+	  pthread_mutex_lock(&heapLocks[owner]);
+	  ptr = kma_heap_malloc(heaps[owner], op->size);
+	  pthread_mutex_unlock(&heapLocks[owner]);
+	  
+	  if ((ptr == NULL) && (op->size <= (MAXRUNPAGES * PAGESIZE - sizeof(void*))))
+	    {
+	      error("got NULL from kma_heap_malloc for alloc'able request", "");
+	    }
+	  
+#ifndef COMPETITION
+	  if (ptr != NULL)
+	    {
+	      fill((char*) ptr, op->size, op->id);
+	    }
 #endif
-
+	  
+	  idPtrs[op->id] = ptr;
+	  idSizes[op->id] = op->size;
+	}
+      else if ((ptr = idPtrs[op->id]) != NULL)
+	{
 #ifndef COMPETITION
-      fprintf(allocTrace, "%d %d %d\n", index, currentAllocBytes, totalBytes);
+	  check((char*) ptr, idSizes[op->id], op->id);
 #endif
+	  
+	  pthread_mutex_lock(&heapLocks[owner]);
+	  kma_heap_free(heaps[owner], ptr, idSizes[op->id]);
+	  pthread_mutex_unlock(&heapLocks[owner]);
+	}
       
-      index += 1;
+      __atomic_store_n(&idTurns[op->id], self->turns[i] + 1, __ATOMIC_RELEASE);
     }
+  
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  self->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  
+  return NULL;
+}
 
-#ifndef COMPETITION
-  fclose(allocTrace);
-#endif
+int
+openMissCounter()
+{
+  struct perf_event_attr attr;
   
+  // count L1 data cache read misses of this thread in user space, to
+  // compare how well the page colors spread the per-page metadata
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_L1D
+    | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+    | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
   
-  stat = page_stats();
+  // the counter is optional, the sweep reports n/a without it
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+long
+readMissCounter(int counter)
+{
+  long misses;
   
-  printf("Page Requested/Freed/In Use: %5d/%5d/%5d\n",
-	 stat->num_requested, stat->num_freed, stat->num_in_use);	
+  if (counter < 0 || read(counter, &misses, sizeof(misses)) != sizeof(misses))
+    {
+      return -1;
+    }
+  
+  return misses;
+}
+
+void
+checkPages()
+{
+  kma_page_stat_t* stat = page_stats();
   
-  if (stat->num_requested != stat->num_freed || stat->num_in_use != 0)
+  int t;
+  
+  if (!partialReplay && restoredPages == 0
+      && (stat->num_requested != stat->num_freed || stat->num_in_use != 0))
     {
       error("not all pages freed", "");
     }
   
+  // the restored blocks keep their pages, though the allocator may have
+  // grown its bookkeeping for them
+  for (t = 0; t < NUMPURPOSES && !partialReplay && restoredPages > 0; t++)
+    {
+      if (t != PAGE_METADATA && stat->num_tagged[t] != restoredTagged[t])
+	{
+	  error("not all pages freed", "");
+	}
+    }
+  
   if(anyMismatches)
     {
       error("there were memory mismatches", "");
     }
+}
 
-#ifdef COMPETITION
-  printf("Competition average ratio: %f\n", ratioSum / ratioCount);
-#endif
+int
+parseSizes(char* arg, long* sizes)
+{
+  int n = 0;
+  char* end;
   
-  pass();
-  return 0;
+  // a comma separated list of sizes in bytes, with an optional K, M or
+  // G suffix
+  do
+    {
+      if (n == MAXSIZES)
+	{
+	  error("too many sizes", arg);
+	}
+      
+      sizes[n] = strtol(arg, &end, 10);
+      switch (*end)
+	{
+	case 'G': case 'g':
+	  sizes[n] <<= 10;
+	  /* fall through */
+	case 'M': case 'm':
+	  sizes[n] <<= 10;
+	  /* fall through */
+	case 'K': case 'k':
+	  sizes[n] <<= 10;
+	  end++;
+	}
+      
+      if (end == arg || sizes[n] <= 0 || (*end != ',' && *end != '\0'))
+	{
+	  error("invalid size", arg);
+	}
+      
+      n++;
+      arg = end + 1;
+    }
+  while (*end == ',');
+  
+  return n;
 }
 
 void
@@ -252,7 +2536,73 @@ pass()
 
 void
 usage() {
-  printf("Usage: %s traceFile\n", name);
+  printf("Usage: %s [-H|--huge] [--page-size=SIZES] [--pool-size=SIZES] [--colors=COLORS] [--sweep] [--shared[=NAME]]\n"
+	 "       [--snapshot=FILE] [--restore=FILE] [--ops=N] [--convert=FILE] [--stream] [--latency[=N]]\n"
+	 "       [--threads=COUNTS] [--remote-frees=FRACTION] [--alg=ALGS] [--bench[=K]] [--warmup=N]\n"
+	 "       [--cpu=N] [--metrics=FORMAT] [--sample=N] [--decimate=FRACTION]\n"
+	 "       [--purge=POLICY] [--retain=PAGES[,MS]] [--release] [--prezero=N] [--fork] traceFile\n", name);
+  printf("  -H, --huge          back the page pool with huge pages\n");
+  printf("  --page-size=SIZES   page size, a power of two from 4K to 64K\n");
+  printf("  --pool-size=SIZES   size of the page pool\n");
+  printf("  --colors=COLORS     number of page colors, a power of two up to 32\n");
+  printf("  --sweep             replay the trace once per page size, pool size\n");
+  printf("                      and number of colors, reporting time, waste\n");
+  printf("                      ratio and L1 data cache misses for each\n");
+  printf("  --shared[=NAME]     allocate from a page pool in shared memory, an\n");
+  printf("                      anonymous memfd or the shm_open() object NAME,\n");
+  printf("                      with the heap at its root\n");
+  printf("  --fork              replay the trace in two processes sharing the pool\n");
+  printf("                      and heap, taking turns by operation, so blocks are\n");
+  printf("                      checked and freed by the other process; implies\n");
+  printf("                      --shared\n");
+  printf("  --snapshot=FILE     save the heap to FILE after the replay\n");
+  printf("  --restore=FILE      replay on top of the heap saved in FILE\n");
+  printf("  --ops=N             replay only the first N operations, leaving\n");
+  printf("                      their blocks allocated\n");
+  printf("  --convert=FILE      write the trace to FILE in the binary format,\n");
+  printf("                      which is replayed without parsing\n");
+  printf("  --stream            replay the trace while reading it, keeping only\n");
+  printf("                      the live requests; implied when traceFile is\n");
+  printf("                      - for stdin or a FIFO\n");
+  printf("  --latency[=N]       time every kma_malloc() and kma_free(), printing\n");
+  printf("                      percentiles per operation and request size and\n");
+  printf("                      the N slowest operations (default 10)\n");
+  printf("  --threads=COUNTS    replay the trace once per thread count, each\n");
+  printf("                      thread with a heap of its own allocating the\n");
+  printf("                      ids it owns, reporting ops/s in aggregate and\n");
+  printf("                      per thread\n");
+  printf("  --remote-frees=FRACTION\n");
+  printf("                      the fraction of the frees done by the thread\n");
+  printf("                      after the owner, under the owner's heap lock\n");
+  printf("  --alg=ALGS          the algorithm, one of dummy, rm, p2fl, mck2, bud\n");
+  printf("                      and lzbud; several are replayed side by side,\n");
+  printf("                      each operation on all of them in turn\n");
+  printf("  --bench[=K]         after the warm-up, replay the trace K times\n");
+  printf("                      (default 5) on a fresh heap each, printing ns\n");
+  printf("                      and cycles per operation and the waste ratio\n");
+  printf("                      on one line\n");
+  printf("  --warmup=N          replays before the timed ones (default 1)\n");
+  printf("  --cpu=N             run on CPU N only\n");
+  printf("  --metrics=FORMAT    write the allocation output as dat (default,\n");
+  printf("                      kma_output.dat), csv (kma_output.csv) or json\n");
+  printf("                      lines (kma_output.jsonl)\n");
+  printf("  --sample=N          write every Nth operation only (default 1)\n");
+  printf("  --decimate=FRACTION write an operation only once the requested or\n");
+  printf("                      allocated bytes moved by FRACTION since the last\n");
+  printf("                      one written\n");
+  printf("  --purge=POLICY      when free pages go back to the system: immediate,\n");
+  printf("                      idle[:PAGES] once more than PAGES are resident\n");
+  printf("                      (the default), or explicit; append ,lazy to\n");
+  printf("                      purge with MADV_FREE\n");
+  printf("  --retain=PAGES[,MS] keep empty extents while fewer than PAGES pages\n");
+  printf("                      are committed, others for MS milliseconds\n");
+  printf("  --release           after the replay, release the empty extents and\n");
+  printf("                      purge the free pages, printing the resident bytes\n");
+  printf("  --prezero=N         after the replay, zero N idle pages ahead of time,\n");
+  printf("                      then take N zeroed pages and check they read zero\n");
+  printf("  SIZES is a comma separated list of byte counts with an optional\n");
+  printf("  K, M or G suffix, COLORS a comma separated list of counts;\n");
+  printf("  several sizes or colors imply --sweep\n");
   exit(0);
 }
 
@@ -263,43 +2613,45 @@ error(char* message, char* arg ) {
 }
 
 void
-allocate(mem_t* requests, int req_id, int req_size)
+allocate(mem_t* new, int req_id, int req_size)
 {
-  mem_t* new = &requests[req_id];
-  
   assert(new->state == FREE);
   
   new->size = req_size;
-  new->ptr = kma_malloc(new->size);
   
-  // Accept a NULL response in some cases... 
-  if(!(((new->ptr != NULL) && (new->size <= (PAGESIZE - sizeof(void*))))
-       || ((new->ptr == NULL) && (new->size > (PAGESIZE - sizeof(void*))))))
+  if (timing)
+    {
+      lastCall.cycles = readCycles();
+      new->ptr = kma_malloc(new->size);
+      lastCall.cycles = readCycles() - lastCall.cycles;
+    }
+  else
+    {
+      new->ptr = kma_malloc(new->size);
+    }
+  lastCall.type = LAT_MALLOC;
+  lastCall.size = req_size;
+  
+  // Accept a NULL response only if no run of pages can hold the request
+  if((new->ptr == NULL) && (new->size <= (MAXRUNPAGES * PAGESIZE - sizeof(void*))))
     {
       error("got NULL from kma_malloc for alloc'able request", "");
     }
   
   if (new->ptr == NULL)
     {
+      new->state = REFUSED;
       return;
     }
 
   currentAllocBytes += req_size;
   
 #ifndef COMPETITION
-  // Only run the actual memory accesses/copies/checks if we're
+  // Only run the actual memory accesses/checks if we're
   // testing for correctness.
   
-  new->value = malloc(new->size);
-  assert(new->value != NULL);
-  
   // initialize memory
-  fill((char*)new->ptr, new->size);
-  
-  // copy the value for further reference
-  bcopy(new->ptr, new->value, new->size);
-  
-  check((char*)new->ptr, (char*)new->value, new->size);
+  fill((char*)new->ptr, new->size, req_id);
   
 #endif
 
@@ -307,9 +2659,13 @@ allocate(mem_t* requests, int req_id, int req_size)
 }
 
 void
-deallocate(mem_t* requests, int req_id)
+deallocate(mem_t* cur, int req_id)
 {
-  mem_t* cur = &requests[req_id];
+  if (cur->state == REFUSED)
+    {
+      cur->state = FREE;
+      return;
+    }
   
   assert(cur->state == USED);
   assert(cur->size > 0);
@@ -318,42 +2674,170 @@ deallocate(mem_t* requests, int req_id)
   // Only run the memory checks if we're testing for correctness.
 
   // check memory
-  check((char*)cur->ptr, (char*)cur->value, cur->size);
-
-  // free memory
-  free(cur->value);
+  check((char*)cur->ptr, cur->size, req_id);
 #endif
 
-  kma_free(cur->ptr, cur->size);
+  if (timing)
+    {
+      lastCall.cycles = readCycles();
+      kma_free(cur->ptr, cur->size);
+      lastCall.cycles = readCycles() - lastCall.cycles;
+    }
+  else
+    {
+      kma_free(cur->ptr, cur->size);
+    }
+  lastCall.type = LAT_FREE;
+  lastCall.size = cur->size;
 
   currentAllocBytes -= cur->size;
   
   cur->state = FREE;
 }
 
+void*
+kma_malloc(kma_size_t size)
+{
+  void* ptr;
+  
+  if (!sharedHeap)
+    {
+      return kma_alg->heap_malloc(kma_alg->default_heap, size);
+    }
+  
+  page_root_lock();
+  ptr = kma_alg->heap_malloc(kma_alg->default_heap, size);
+  page_root_unlock();
+  
+  return ptr;
+}
+
+void
+kma_free(void* ptr, kma_size_t size)
+{
+  if (!sharedHeap)
+    {
+      kma_alg->heap_free(kma_alg->default_heap, ptr, size);
+      return;
+    }
+  
+  page_root_lock();
+  kma_alg->heap_free(kma_alg->default_heap, ptr, size);
+  page_root_unlock();
+}
+
+kma_heap_t*
+kma_heap_create()
+{
+  return kma_alg->heap_create();
+}
+
+void
+kma_heap_destroy(kma_heap_t* heap)
+{
+  kma_alg->heap_destroy(heap);
+}
+
+void*
+kma_heap_malloc(kma_heap_t* heap, kma_size_t size)
+{
+  return kma_alg->heap_malloc(heap, size);
+}
+
+void
+kma_heap_free(kma_heap_t* heap, void* ptr, kma_size_t size)
+{
+  kma_alg->heap_free(heap, ptr, size);
+}
+
+void
+kma_snapshot(char* path)
+{
+  kma_alg->snapshot(path);
+}
+
+void
+kma_restore(char* path)
+{
+  kma_alg->restore(path);
+}
+
+// the first word of the pattern of a request
+static inline unsigned long
+patternSeed(int req_id)
+{
+  return ((unsigned long) req_id + 1) * 0x9E3779B97F4A7C15UL;
+}
+
 void
-fill(char* ptr, int size)
+fill(char* ptr, int size, int req_id)
 {
+  unsigned long word = patternSeed(req_id);
+  pattern_t words = { word, word + PATTERNSTEP };
+  pattern_t step = { 2 * PATTERNSTEP, 2 * PATTERNSTEP };
   int i;
   
-  for (i = 0; i < size; i++)
+  // blocks need not be aligned, so the stores are memcpy()s
+  for (i = 0; i + sizeof(pattern_t) <= size; i += sizeof(pattern_t))
+    {
+      memcpy(ptr + i, &words, sizeof(pattern_t));
+      words += step;
+    }
+  
+  for (word = words[0]; i + sizeof(word) <= size; i += sizeof(word))
     {
-      ptr[i] = (char) val++;
+      memcpy(ptr + i, &word, sizeof(word));
+      word += PATTERNSTEP;
     }
+  
+  // the tail is the start of the next word
+  memcpy(ptr + i, &word, size - i);
 }
 
 void
-check(char* lhs, char* rhs, int size)
+check(char* ptr, int size, int req_id)
 {
+  unsigned long word = patternSeed(req_id);
+  pattern_t words = { word, word + PATTERNSTEP };
+  pattern_t step = { 2 * PATTERNSTEP, 2 * PATTERNSTEP };
+  pattern_t loaded, diff = { 0, 0 };
+  unsigned long got, bad;
   int i;
   
+  // the differences are only collected, the loop has no branch
+  for (i = 0; i + sizeof(pattern_t) <= size; i += sizeof(pattern_t))
+    {
+      memcpy(&loaded, ptr + i, sizeof(pattern_t));
+      diff |= loaded ^ words;
+      words += step;
+    }
+  bad = diff[0] | diff[1];
+  
+  for (word = words[0]; i + sizeof(word) <= size; i += sizeof(word))
+    {
+      memcpy(&got, ptr + i, sizeof(got));
+      bad |= got ^ word;
+      word += PATTERNSTEP;
+    }
+  
+  got = word;
+  memcpy(&got, ptr + i, size - i);
+  bad |= got ^ word;
+  
+  if (bad == 0)
+    {
+      return;
+    }
+  
+  // find the bytes again, to report them
   for (i = 0; i < size; i++)
     {
-      if (lhs[i] != rhs[i])
+      word = patternSeed(req_id) + (i / sizeof(word)) * PATTERNSTEP;
+      if (ptr[i] != ((char*) &word)[i % sizeof(word)])
 	{
 	  fprintf(stderr, "memory mismatch at position %d (%3d!=%3d)\n", 
-		  i, lhs[i], rhs[i]);
-	  anyMismatches = 1;
+		  i, ptr[i], ((char*) &word)[i % sizeof(word)]);
 	}
     }
+  __atomic_store_n(&anyMismatches, 1, __ATOMIC_RELAXED);
 }
@@ -31,7 +31,6 @@
  *    - initial version for the kernel memory allocator project
  *
  ***************************************************************************/
-#ifdef KMA_BUD
 #define __KMA_IMPL__
 
 /************System include***********************************************/
@@ -55,6 +54,19 @@
    unsigned short info;
  } block_header_t;
 
+// blocks are at least four bytes, so info holds half the block size,
+// which keeps a 64K page in 16 bits, and the used flag in bit 0
+#define USEDFLAG 1
+#define INFOSIZE(b) ((size_t)((b)->info & ~USEDFLAG) << 1)
+#define SETINFOSIZE(b, s) ((b)->info = (unsigned short)((s) >> 1))
+
+// the header of a book-keeping page sits at the color offset of the page
+#define KEEPER(x) ((bookkeeping_header_t*)((size_t)BASEADDR(x) + PAGECOLOR(x)))
+
+// pages given up by one kma_malloc/kma_free call, released together;
+// each coalescing step frees at most one book-keeping page
+#define MAXRELEASED 32
+
  typedef struct block_t
  {
    block_header_t* block;
@@ -88,8 +100,18 @@
 
 
 
+// a heap made by kma_heap_create() sits at the start of a zeroed page
+// of its own, so it starts out with no pages and nothing released
+struct kma_heap
+{
+  kma_page_group_t pages;
+  kma_page_t* bookkeepingPage;
+  kma_page_t* releasedPages[MAXRELEASED];
+  int numReleased;
+};
+
 /************Global Variables*********************************************/
-static kma_page_t* bookkeepingPage = NULL;
+static kma_heap_t defaultHeap;
 //static int count = 0;
 /************Function Prototypes******************************************/
 inline int NextPowerOfTwo(int);
@@ -98,12 +120,14 @@ inline bool Used(block_header_t*, size_t);
 block_header_t* Buddy(block_header_t*, int);
 bookkeeping_header_t* InitializePageKeeper(kma_page_t*);
 bookkeeping_header_t* InitializeBlockKeeper(kma_page_t*);
-block_t* AddAllocedPage(void);
-void RemoveAllocedPage(block_header_t*);
-block_t* Split(block_t*, int);
-block_header_t* RemoveBlockFromList(block_t*);
-block_header_t* RemoveBlockHeaderFromList(block_header_t*);
-void AddBlockToList(block_header_t*, int);
+block_t* AddAllocedPage(kma_heap_t*);
+void RemoveAllocedPage(kma_heap_t*, block_header_t*);
+block_t* Split(kma_heap_t*, block_t*, int);
+block_header_t* RemoveBlockFromList(kma_heap_t*, block_t*);
+block_header_t* RemoveBlockHeaderFromList(kma_heap_t*, block_header_t*);
+void AddBlockToList(kma_heap_t*, block_header_t*, int);
+void ReleasePage(kma_heap_t*, kma_page_t*);
+void FlushReleasedPages(kma_heap_t*);
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
@@ -119,7 +143,7 @@ inline int NextPowerOfTwo(int n)
 
 inline bool Used(block_header_t* block, size_t size)
 {
-  return (block->info & (PAGESIZE << 1)) || (block->info < size);
+  return (block->info & USEDFLAG) || (INFOSIZE(block) < size);
 }
 
 
@@ -139,7 +163,7 @@ block_header_t* Buddy(block_header_t* block, int size)
 
 bookkeeping_header_t* InitializePageKeeper(kma_page_t* page)
 {
-  bookkeeping_header_t* header = (bookkeeping_header_t*)(page->ptr);
+  bookkeeping_header_t* header = KEEPER(page->ptr);
   header->numHeaders = 0;
   header->thisPage = page;
  
@@ -165,7 +189,7 @@ bookkeeping_header_t* InitializePageKeeper(kma_page_t* page)
 
 bookkeeping_header_t* InitializeBlockKeeper(kma_page_t* page)
 {
-  bookkeeping_header_t* header = (bookkeeping_header_t*)(page->ptr);
+  bookkeeping_header_t* header = KEEPER(page->ptr);
   header->numHeaders = 0;
   header->thisPage = page;
   
@@ -187,21 +211,35 @@ bookkeeping_header_t* InitializeBlockKeeper(kma_page_t* page)
   return header;
 }
 
-block_t* AddAllocedPage(void)
+block_t* AddAllocedPage(kma_heap_t* heap)
 {
-  bookkeeping_header_t* header = (bookkeeping_header_t*)(bookkeepingPage->ptr);
-  kma_page_t* newPage = get_page();
+  bookkeeping_header_t* header = KEEPER(heap->bookkeepingPage->ptr);
   bookkeeping_header_t* thisBookkeepingPage;
+
+  // get the book-keeping pages the new page needs in one batch
+  kma_page_t* newPages[2];
+  int numNew = 0;
+  if(header->lastPage->next == NULL)
+    numNew++;
+  if(header->lastBlock == NULL || header->lastBlock->next == NULL)
+    numNew++;
+  get_pages_batch(numNew, newPages, PAGE_METADATA);
+  kma_page_t* newPage = get_page(PAGE_DATA);
+  int j;
+  for(j = 0; j < numNew; j++)
+    page_group_add(&heap->pages, newPages[j]);
+  page_group_add(&heap->pages, newPage);
+
   if(header->lastPage->next == NULL)
   {
-    kma_page_t* newPageKeeper = get_page();
+    kma_page_t* newPageKeeper = newPages[--numNew];
     thisBookkeepingPage = InitializePageKeeper(newPageKeeper);
     page_t* firstPageStruct = (page_t*)((size_t)thisBookkeepingPage + sizeof(bookkeeping_header_t));
     firstPageStruct->prev = header->lastPage;
     header->lastPage->next = firstPageStruct;
   }
   else
-    thisBookkeepingPage = (bookkeeping_header_t*)BASEADDR(header->lastPage->next);
+    thisBookkeepingPage = KEEPER(header->lastPage->next);
 
   header->lastPage->next->page = newPage;
   header->lastPage->next->structUsed = TRUE;
@@ -210,10 +248,10 @@ block_t* AddAllocedPage(void)
 
 
   block_header_t* newBlock = (block_header_t*)(newPage->ptr);
-  newBlock->info = PAGESIZE;
+  SETINFOSIZE(newBlock, PAGESIZE);
   if(header->lastBlock == NULL)
   {
-    kma_page_t* newBlockKeeper = get_page();
+    kma_page_t* newBlockKeeper = newPages[--numNew];
     thisBookkeepingPage = InitializeBlockKeeper(newBlockKeeper);
     block_t* firstBlockStruct = (block_t*)((size_t)thisBookkeepingPage + sizeof(bookkeeping_header_t));
     firstBlockStruct->prev = NULL;
@@ -227,14 +265,14 @@ block_t* AddAllocedPage(void)
   }
   if(header->lastBlock->next == NULL)
   {
-    kma_page_t* newBlockKeeper = get_page();
+    kma_page_t* newBlockKeeper = newPages[--numNew];
     thisBookkeepingPage = InitializeBlockKeeper(newBlockKeeper);
     block_t* firstBlockStruct = (block_t*)((size_t)thisBookkeepingPage + sizeof(bookkeeping_header_t));
     firstBlockStruct->prev = header->lastBlock;
     header->lastBlock->next = firstBlockStruct;
   }
   else
-    thisBookkeepingPage = (bookkeeping_header_t*)BASEADDR(header->lastBlock->next);
+    thisBookkeepingPage = KEEPER(header->lastBlock->next);
 
   header->lastBlock->next->block = newBlock;
   header->lastBlock->next->size = PAGESIZE;
@@ -245,13 +283,13 @@ block_t* AddAllocedPage(void)
   return header->lastBlock;
 }
 
-void RemoveAllocedPage(block_header_t* block)
+void RemoveAllocedPage(kma_heap_t* heap, block_header_t* block)
 {
-  bookkeeping_header_t* header = (bookkeeping_header_t*)(bookkeepingPage->ptr);
+  bookkeeping_header_t* header = KEEPER(heap->bookkeepingPage->ptr);
   page_t* i;
   for(i = header->firstPage; i->page->ptr != (void*)block; i = i->next){}
 
-  free_page(i->page);
+  ReleasePage(heap, i->page);
 
   if(i->prev == NULL)
   {
@@ -278,14 +316,14 @@ void RemoveAllocedPage(block_header_t* block)
     header->lastPage->next = i;
   }
 
-  bookkeeping_header_t* thisBookkeepingPage = (bookkeeping_header_t*)BASEADDR(i);
+  bookkeeping_header_t* thisBookkeepingPage = KEEPER(i);
   thisBookkeepingPage->numHeaders--;
 
   if(thisBookkeepingPage->numHeaders == 0)
   {
     for(i = header->lastPage; i != NULL; i = i->next)
     {
-      if(BASEADDR(i) == (void*)thisBookkeepingPage)
+      if(KEEPER(i) == thisBookkeepingPage)
       {
         i->prev->next = i->next;
         if(i->next != NULL)
@@ -293,34 +331,35 @@ void RemoveAllocedPage(block_header_t* block)
       }
     }
 
-    if(thisBookkeepingPage->thisPage == bookkeepingPage)
+    if(thisBookkeepingPage->thisPage == heap->bookkeepingPage)
     {
       if(thisBookkeepingPage->firstPage != NULL)
       {
-        bookkeepingPage = ((bookkeeping_header_t*)BASEADDR(thisBookkeepingPage->firstPage))->thisPage;
-        bookkeeping_header_t* newFirstPage = (bookkeeping_header_t*)(bookkeepingPage->ptr);
+        heap->bookkeepingPage = KEEPER(thisBookkeepingPage->firstPage)->thisPage;
+        bookkeeping_header_t* newFirstPage = KEEPER(heap->bookkeepingPage->ptr);
         newFirstPage->firstBlock = thisBookkeepingPage->firstBlock;
         newFirstPage->lastBlock = thisBookkeepingPage->lastBlock;
         newFirstPage->firstPage = thisBookkeepingPage->firstPage;
         newFirstPage->lastPage = thisBookkeepingPage->lastPage;
       }
       else
-        bookkeepingPage = NULL;
+        heap->bookkeepingPage = NULL;
     }
-    free_page(thisBookkeepingPage->thisPage);
+    ReleasePage(heap, thisBookkeepingPage->thisPage);
   }
 }
 
-void AddBlockToList(block_header_t* block, int size)
+void AddBlockToList(kma_heap_t* heap, block_header_t* block, int size)
 {
-  bookkeeping_header_t* header = (bookkeeping_header_t*)(bookkeepingPage->ptr);
+  bookkeeping_header_t* header = KEEPER(heap->bookkeepingPage->ptr);
   if(header->lastBlock == NULL)
   {
-    kma_page_t* newBlockKeeper = get_page();
+    kma_page_t* newBlockKeeper = get_page(PAGE_METADATA);
+    page_group_add(&heap->pages, newBlockKeeper);
     bookkeeping_header_t* thisBlockKeeper = InitializeBlockKeeper(newBlockKeeper);
     block_t* firstBlock = (block_t*)((size_t)thisBlockKeeper + sizeof(*thisBlockKeeper));
     firstBlock->block = block;
-    firstBlock->size = block->info;
+    firstBlock->size = INFOSIZE(block);
     firstBlock->prev = NULL;
     firstBlock->structUsed = TRUE;
     header->firstBlock = firstBlock;
@@ -329,11 +368,12 @@ void AddBlockToList(block_header_t* block, int size)
   }
   else if(header->lastBlock->next == NULL)
   {
-    kma_page_t* newBlockKeeper = get_page();
+    kma_page_t* newBlockKeeper = get_page(PAGE_METADATA);
+    page_group_add(&heap->pages, newBlockKeeper);
     bookkeeping_header_t* thisBlockKeeper = InitializeBlockKeeper(newBlockKeeper);
     block_t* firstBlock = (block_t*)((size_t)thisBlockKeeper + sizeof(*thisBlockKeeper));
     firstBlock->block = block;
-    firstBlock->size = block->info;
+    firstBlock->size = INFOSIZE(block);
     firstBlock->structUsed = TRUE;
     firstBlock->prev = header->lastBlock;
     header->lastBlock->next = firstBlock;
@@ -344,40 +384,50 @@ void AddBlockToList(block_header_t* block, int size)
   {
     block_t* nextBlock = header->lastBlock->next;
     nextBlock->block = block;
-    nextBlock->size = block->info;
+    nextBlock->size = INFOSIZE(block);
     nextBlock->structUsed = TRUE;
     header->lastBlock = nextBlock;
-    ((bookkeeping_header_t*)BASEADDR(nextBlock))->numHeaders++;
+    KEEPER(nextBlock)->numHeaders++;
   }
 }
 
 
-block_t* Split(block_t* block, int size)
+block_t* Split(kma_heap_t* heap, block_t* block, int size)
 {
+  // keep the half holding the color offset of the page, so the first
+  // small blocks of different pages fall into different cache sets
+  size_t target = (size_t)BASEADDR(block->block) + PAGECOLOR(block->block);
+
   while(block->size > size)
   {
     block->size >>= 1;
     block_header_t* buddy = Buddy(block->block, block->size);
-    buddy->info = block->size;
-    AddBlockToList(buddy, block->size);
+    if(target >= (size_t)buddy && target < (size_t)buddy + block->size)
+    {
+      block_header_t* low = block->block;
+      block->block = buddy;
+      buddy = low;
+    }
+    SETINFOSIZE(buddy, block->size);
+    AddBlockToList(heap, buddy, block->size);
   }
-  block->block->info = block->size;
+  SETINFOSIZE(block->block, block->size);
 
   return block;
 }
 
-block_header_t* RemoveBlockHeaderFromList(block_header_t* block)
+block_header_t* RemoveBlockHeaderFromList(kma_heap_t* heap, block_header_t* block)
 {
-  bookkeeping_header_t* header = (bookkeeping_header_t*)(bookkeepingPage->ptr);
+  bookkeeping_header_t* header = KEEPER(heap->bookkeepingPage->ptr);
   block_t* i;
   for(i = header->firstBlock; i->block != block; i = i->next){}
-  return RemoveBlockFromList(i);
+  return RemoveBlockFromList(heap, i);
 }
 
-block_header_t* RemoveBlockFromList(block_t* block)
+block_header_t* RemoveBlockFromList(kma_heap_t* heap, block_t* block)
 {
   block_header_t* ret = block->block;
-  bookkeeping_header_t* header = (bookkeeping_header_t*)(bookkeepingPage->ptr);
+  bookkeeping_header_t* header = KEEPER(heap->bookkeepingPage->ptr);
 
   if(block->prev == NULL)
   {
@@ -404,7 +454,7 @@ block_header_t* RemoveBlockFromList(block_t* block)
     header->lastBlock->next = block;
   }
 
-  bookkeeping_header_t* thisBookkeepingPage = (bookkeeping_header_t*)BASEADDR(block);
+  bookkeeping_header_t* thisBookkeepingPage = KEEPER(block);
   thisBookkeepingPage->numHeaders--;
 
   if(thisBookkeepingPage->numHeaders == 0)
@@ -412,33 +462,79 @@ block_header_t* RemoveBlockFromList(block_t* block)
     block_t* i;
     for(i = header->lastBlock; i != NULL; i = i->next)
     {
-      if(BASEADDR(i) == (void*)thisBookkeepingPage)
+      if(KEEPER(i) == thisBookkeepingPage)
       {
         i->prev->next = i->next;
         if(i->next != NULL)
           i->next->prev = i->prev;
       }
     }
-    free_page(thisBookkeepingPage->thisPage);
+    ReleasePage(heap, thisBookkeepingPage->thisPage);
   }
   return ret;
 }
 
 
-void*
-kma_malloc(kma_size_t size)
+void ReleasePage(kma_heap_t* heap, kma_page_t* page)
+{
+  if(heap->numReleased == MAXRELEASED)
+    FlushReleasedPages(heap);
+  heap->releasedPages[heap->numReleased++] = page;
+}
+
+void FlushReleasedPages(kma_heap_t* heap)
+{
+  if(heap->numReleased > 0)
+    free_pages_batch(heap->releasedPages, heap->numReleased);
+  heap->numReleased = 0;
+}
+
+
+static kma_heap_t*
+bud_heap_create()
+{
+  kma_page_t* page = get_zeroed_page(PAGE_METADATA);
+  
+  return (kma_heap_t*)page->ptr;
+}
+
+static void
+bud_heap_destroy(kma_heap_t* heap)
+{
+  // the book-keeping pages are in the group too, nothing is walked
+  free_page_group(&heap->pages);
+  free_page(find_page(heap));
+}
+
+static void*
+bud_heap_malloc(kma_heap_t* heap, kma_size_t size)
 {
   
+  // blocks larger than a page are runs of pages without a block header,
+  // bud_heap_free() knows them by their size
+  if(NextPowerOfTwo(size + sizeof(block_header_t)) > PAGESIZE)
+  {
+    kma_page_t* run = get_pages((size + PAGESIZE - 1) / PAGESIZE, PAGE_LARGE);
+    if(run == NULL)
+      return NULL;
+    page_group_add(&heap->pages, run);
+    return run->ptr;
+  }
+
   size = NextPowerOfTwo(size + sizeof(block_header_t));
-  if(size > PAGESIZE)
-    return NULL;
 
-  if(bookkeepingPage == NULL)
+  if(heap->bookkeepingPage == NULL)
   {
-    bookkeepingPage = get_page();
-    bookkeeping_header_t* header = InitializePageKeeper(bookkeepingPage);
+    kma_page_t* newPages[2];
+    get_pages_batch(2, newPages, PAGE_METADATA);
+    page_group_add(&heap->pages, newPages[0]);
+    page_group_add(&heap->pages, newPages[1]);
+
+    heap->bookkeepingPage = newPages[0];
+    bookkeeping_header_t* header = InitializePageKeeper(heap->bookkeepingPage);
 
-    kma_page_t* newAllocedPage = get_page();
+    kma_page_t* newAllocedPage = get_page(PAGE_DATA);
+    page_group_add(&heap->pages, newAllocedPage);
     page_t* firstPage = (page_t*)((size_t)header + sizeof(*header));
     firstPage->page = newAllocedPage;
     firstPage->prev = NULL;
@@ -447,11 +543,11 @@ kma_malloc(kma_size_t size)
     header->lastPage = firstPage;
     header->numHeaders = 1;
 
-    kma_page_t* blockBookkeepingPage = get_page();
+    kma_page_t* blockBookkeepingPage = newPages[1];
     bookkeeping_header_t* blockPage = InitializeBlockKeeper(blockBookkeepingPage);
     block_t* firstBlock = (block_t*)((size_t)blockPage + sizeof(*blockPage));
     firstBlock->block = (block_header_t*)(newAllocedPage->ptr);
-    firstBlock->block->info = PAGESIZE;
+    SETINFOSIZE(firstBlock->block, PAGESIZE);
     firstBlock->size = PAGESIZE;
     firstBlock->prev = NULL;
     firstBlock->structUsed = TRUE;
@@ -461,7 +557,7 @@ kma_malloc(kma_size_t size)
   }
 
 
-  bookkeeping_header_t* header = (bookkeeping_header_t*)(bookkeepingPage->ptr);
+  bookkeeping_header_t* header = KEEPER(heap->bookkeepingPage->ptr);
 
   block_t* i;
   block_t* minBlock = NULL;
@@ -476,12 +572,13 @@ kma_malloc(kma_size_t size)
       minBlock = i;
   }
   if(minBlock == NULL)
-    minBlock = AddAllocedPage();
+    minBlock = AddAllocedPage(heap);
 
-  minBlock = Split(minBlock, size);
-  minBlock->block->info |= (PAGESIZE << 1);
+  minBlock = Split(heap, minBlock, size);
+  minBlock->block->info |= USEDFLAG;
 
-  block_header_t* ret = RemoveBlockFromList(minBlock);
+  block_header_t* ret = RemoveBlockFromList(heap, minBlock);
+  FlushReleasedPages(heap);
   
  
  
@@ -490,15 +587,21 @@ kma_malloc(kma_size_t size)
 
 }
 
-void 
-kma_free(void* ptr, kma_size_t size)
+static void
+bud_heap_free(kma_heap_t* heap, void* ptr, kma_size_t size)
 {
-  bookkeeping_header_t* header = (bookkeeping_header_t*)(bookkeepingPage->ptr);
+  if(NextPowerOfTwo(size + sizeof(block_header_t)) > PAGESIZE)
+  {
+    free_page(find_page(ptr));
+    return;
+  }
+
+  bookkeeping_header_t* header = KEEPER(heap->bookkeepingPage->ptr);
   block_header_t* blockHeader = (block_header_t*)((size_t)ptr - sizeof(block_header_t));
-  blockHeader->info &= ~(PAGESIZE << 1);
-  block_header_t* buddy = Buddy(blockHeader, blockHeader->info);
+  blockHeader->info &= ~USEDFLAG;
+  block_header_t* buddy = Buddy(blockHeader, INFOSIZE(blockHeader));
   bool coalesced = FALSE;
-  while(buddy != NULL && !Used(buddy, blockHeader->info))
+  while(buddy != NULL && !Used(buddy, INFOSIZE(blockHeader)))
   {
     if(!coalesced)
     {
@@ -508,7 +611,7 @@ kma_free(void* ptr, kma_size_t size)
       i->block = (((size_t)blockHeader < (size_t)buddy) ? blockHeader : buddy);
       i->block->info <<= 1;
       blockHeader = i->block;
-      buddy = Buddy(blockHeader, blockHeader->info);
+      buddy = Buddy(blockHeader, INFOSIZE(blockHeader));
       coalesced = TRUE;
     }
     else
@@ -519,23 +622,57 @@ kma_free(void* ptr, kma_size_t size)
       for(j = header->firstBlock; j->block != buddy; j = j->next){}
       block_t* lowBuddy = (((size_t)(i->block) < (size_t)(j->block)) ? i : j);
       block_t* highBuddy = lowBuddy == i ? j : i;
-      RemoveBlockFromList(highBuddy);
+      RemoveBlockFromList(heap, highBuddy);
       lowBuddy->size <<= 1;
       lowBuddy->block->info <<= 1;
       blockHeader = lowBuddy->block;
-      buddy = Buddy(blockHeader, blockHeader->info);
+      buddy = Buddy(blockHeader, INFOSIZE(blockHeader));
     }
   }
 
   if(!coalesced)
-    AddBlockToList(blockHeader, blockHeader->info);
+    AddBlockToList(heap, blockHeader, INFOSIZE(blockHeader));
 
   if(buddy == NULL)
   {
-    RemoveBlockHeaderFromList(blockHeader);
-    RemoveAllocedPage(blockHeader);
+    RemoveBlockHeaderFromList(heap, blockHeader);
+    RemoveAllocedPage(heap, blockHeader);
   }
 
+  FlushReleasedPages(heap);
+
+}
+
+static int
+bud_heap_pages(kma_heap_t* heap)
+{
+  return heap->pages.num_pages;
 }
 
-#endif // KMA_BUD
+static void
+bud_snapshot(char* path)
+{
+  // released pages are flushed by every call, so the heap only holds
+  // its page group and the keeper
+  page_snapshot(path, &defaultHeap, sizeof(defaultHeap));
+}
+
+static void
+bud_restore(char* path)
+{
+  page_restore(path, &defaultHeap, sizeof(defaultHeap));
+}
+
+kma_ops_t kma_bud_ops =
+  {
+    .name         = "bud",
+    .default_heap = &defaultHeap,
+    .heap_size    = sizeof(kma_heap_t),
+    .heap_create  = bud_heap_create,
+    .heap_destroy = bud_heap_destroy,
+    .heap_malloc  = bud_heap_malloc,
+    .heap_free    = bud_heap_free,
+    .heap_pages   = bud_heap_pages,
+    .snapshot     = bud_snapshot,
+    .restore      = bud_restore
+  };
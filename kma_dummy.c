@@ -40,7 +40,6 @@
  *    - initial version for the kernel memory allocator project
  *
  ***************************************************************************/
-#ifdef KMA_DUMMY
 #define __KMA_IMPL__
 
 /************System include***********************************************/
@@ -58,7 +57,15 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+// a heap is nothing but its pages; one made by kma_heap_create() sits
+// at the start of a page of its own
+struct kma_heap
+{
+  kma_page_group_t pages;
+};
+
 /************Global Variables*********************************************/
+static kma_heap_t defaultHeap;
 
 /************Function Prototypes******************************************/
 
@@ -66,22 +73,38 @@
 
 /**************Implementation***********************************************/
 
-void* kma_malloc(kma_size_t size)
+static kma_heap_t* dummy_heap_create()
 {
-  kma_page_t* page;
+  kma_page_t* page = get_page(PAGE_METADATA);
+  kma_heap_t* heap = (kma_heap_t*) page->ptr;
   
-  // get one page
-  page = get_page();
+  heap->pages.first = NULL;
+  heap->pages.num_pages = 0;
+  
+  return heap;
+}
+
+static void dummy_heap_destroy(kma_heap_t* heap)
+{
+  free_page_group(&heap->pages);
+  free_page(find_page(heap));
+}
+
+static void* dummy_heap_malloc(kma_heap_t* heap, kma_size_t size)
+{
+  kma_page_t* page;
   
-  // add a pointer to the page structure at the beginning of the page
-  *((kma_page_t**)page->ptr) = page;
+  // get as many contiguous pages as the request needs
+  page = get_pages((size + PAGESIZE - 1) / PAGESIZE,
+		   (size > PAGESIZE) ? PAGE_LARGE : PAGE_DATA);
   
-  if ((size + sizeof(kma_page_t*)) > page->size)
+  if (page == NULL)
     { // requested size too large
-      free_page(page);
       return NULL;
     }
   
+  page_group_add(&heap->pages, page);
+  
   // check whether the BASEADDR macro works
   //for (i = 0; i < page->size; i++)
   //{
@@ -89,16 +112,44 @@ void* kma_malloc(kma_size_t size)
   //}
   // oh yea, it worked
   
-  return page->ptr + sizeof(kma_page_t*);
+  return page->ptr;
 }
 
-void kma_free(void* ptr, kma_size_t size)
+static void dummy_heap_free(kma_heap_t* heap, void* ptr, kma_size_t size)
 {
   kma_page_t* page;
   
-  page = *((kma_page_t**)(ptr - sizeof(kma_page_t*)));
+  // the page structure is found through the page descriptor table
+  page = find_page(ptr);
   
   free_page(page);
 }
 
-#endif // KMA_DUMMY
+static int dummy_heap_pages(kma_heap_t* heap)
+{
+  return heap->pages.num_pages;
+}
+
+static void dummy_snapshot(char* path)
+{
+  page_snapshot(path, &defaultHeap, sizeof(defaultHeap));
+}
+
+static void dummy_restore(char* path)
+{
+  page_restore(path, &defaultHeap, sizeof(defaultHeap));
+}
+
+kma_ops_t kma_dummy_ops =
+  {
+    .name         = "dummy",
+    .default_heap = &defaultHeap,
+    .heap_size    = sizeof(kma_heap_t),
+    .heap_create  = dummy_heap_create,
+    .heap_destroy = dummy_heap_destroy,
+    .heap_malloc  = dummy_heap_malloc,
+    .heap_free    = dummy_heap_free,
+    .heap_pages   = dummy_heap_pages,
+    .snapshot     = dummy_snapshot,
+    .restore      = dummy_restore
+  };
@@ -32,7 +32,6 @@
  *    - initial version for the kernel memory allocator project
  *
  ***************************************************************************/
-#ifdef KMA_LZBUD
 #define __KMA_IMPL__
 
 /************System include***********************************************/
@@ -50,7 +49,13 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+struct kma_heap
+{
+  kma_page_group_t pages;
+};
+
 /************Global Variables*********************************************/
+static kma_heap_t defaultHeap;
 
 /************Function Prototypes******************************************/
 
@@ -58,16 +63,65 @@
 
 /**************Implementation***********************************************/
 
-void*
-kma_malloc(kma_size_t size)
+static kma_heap_t*
+lzbud_heap_create()
+{
+  kma_page_t* page = get_page(PAGE_METADATA);
+  kma_heap_t* heap = (kma_heap_t*) page->ptr;
+  
+  heap->pages.first = NULL;
+  heap->pages.num_pages = 0;
+  
+  return heap;
+}
+
+static void
+lzbud_heap_destroy(kma_heap_t* heap)
+{
+  free_page_group(&heap->pages);
+  free_page(find_page(heap));
+}
+
+static void*
+lzbud_heap_malloc(kma_heap_t* heap, kma_size_t size)
 {
   return NULL;
 }
 
-void
-kma_free(void* ptr, kma_size_t size)
+static void
+lzbud_heap_free(kma_heap_t* heap, void* ptr, kma_size_t size)
 {
   ;
 }
 
-#endif // KMA_LZBUD
+static int
+lzbud_heap_pages(kma_heap_t* heap)
+{
+  return heap->pages.num_pages;
+}
+
+static void
+lzbud_snapshot(char* path)
+{
+  page_snapshot(path, &defaultHeap, sizeof(defaultHeap));
+}
+
+static void
+lzbud_restore(char* path)
+{
+  page_restore(path, &defaultHeap, sizeof(defaultHeap));
+}
+
+kma_ops_t kma_lzbud_ops =
+  {
+    .name         = "lzbud",
+    .default_heap = &defaultHeap,
+    .heap_size    = sizeof(kma_heap_t),
+    .heap_create  = lzbud_heap_create,
+    .heap_destroy = lzbud_heap_destroy,
+    .heap_malloc  = lzbud_heap_malloc,
+    .heap_free    = lzbud_heap_free,
+    .heap_pages   = lzbud_heap_pages,
+    .snapshot     = lzbud_snapshot,
+    .restore      = lzbud_restore
+  };
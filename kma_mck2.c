@@ -32,7 +32,6 @@
  *    - initial version for the kernel memory allocator project
  *
  ***************************************************************************/
-#ifdef KMA_MCK2
 #define __KMA_IMPL__
 
 /************System include***********************************************/
@@ -50,7 +49,13 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+struct kma_heap
+{
+  kma_page_group_t pages;
+};
+
 /************Global Variables*********************************************/
+static kma_heap_t defaultHeap;
 
 /************Function Prototypes******************************************/
 
@@ -58,16 +63,65 @@
 
 /**************Implementation***********************************************/
 
-void*
-kma_malloc(kma_size_t size)
+static kma_heap_t*
+mck2_heap_create()
+{
+  kma_page_t* page = get_page(PAGE_METADATA);
+  kma_heap_t* heap = (kma_heap_t*) page->ptr;
+  
+  heap->pages.first = NULL;
+  heap->pages.num_pages = 0;
+  
+  return heap;
+}
+
+static void
+mck2_heap_destroy(kma_heap_t* heap)
+{
+  free_page_group(&heap->pages);
+  free_page(find_page(heap));
+}
+
+static void*
+mck2_heap_malloc(kma_heap_t* heap, kma_size_t size)
 {
   return NULL;
 }
 
-void
-kma_free(void* ptr, kma_size_t size)
+static void
+mck2_heap_free(kma_heap_t* heap, void* ptr, kma_size_t size)
 {
   ;
 }
 
-#endif // KMA_MCK2
+static int
+mck2_heap_pages(kma_heap_t* heap)
+{
+  return heap->pages.num_pages;
+}
+
+static void
+mck2_snapshot(char* path)
+{
+  page_snapshot(path, &defaultHeap, sizeof(defaultHeap));
+}
+
+static void
+mck2_restore(char* path)
+{
+  page_restore(path, &defaultHeap, sizeof(defaultHeap));
+}
+
+kma_ops_t kma_mck2_ops =
+  {
+    .name         = "mck2",
+    .default_heap = &defaultHeap,
+    .heap_size    = sizeof(kma_heap_t),
+    .heap_create  = mck2_heap_create,
+    .heap_destroy = mck2_heap_destroy,
+    .heap_malloc  = mck2_heap_malloc,
+    .heap_free    = mck2_heap_free,
+    .heap_pages   = mck2_heap_pages,
+    .snapshot     = mck2_snapshot,
+    .restore      = mck2_restore
+  };
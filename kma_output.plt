@@ -5,4 +5,13 @@ plot "kma_output.dat" using 1:2 with lines title "Requested", \
 
 set output "kma_waste.png"
 plot "kma_output.dat" using 1:($3-$2) with lines title "Waste"
+
+# the first line is the empty heap, which has neither waste nor rate
+set output "kma_waste_pct.png"
+set yrange [0:100]
+plot "kma_output.dat" every ::1 using 1:4 with lines title "Waste %"
+
+set output "kma_rate.png"
+set autoscale y
+plot "kma_output.dat" every ::1 using 1:5 with lines title "Ops/s"
      
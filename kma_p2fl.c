@@ -32,7 +32,6 @@
  *    - initial version for the kernel memory allocator project
  *
  ***************************************************************************/
-#ifdef KMA_P2FL
 #define __KMA_IMPL__
 
 /************System include***********************************************/
@@ -50,7 +49,13 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+struct kma_heap
+{
+  kma_page_group_t pages;
+};
+
 /************Global Variables*********************************************/
+static kma_heap_t defaultHeap;
 
 /************Function Prototypes******************************************/
 
@@ -58,16 +63,65 @@
 
 /**************Implementation***********************************************/
 
-void*
-kma_malloc(kma_size_t size)
+static kma_heap_t*
+p2fl_heap_create()
+{
+  kma_page_t* page = get_page(PAGE_METADATA);
+  kma_heap_t* heap = (kma_heap_t*) page->ptr;
+  
+  heap->pages.first = NULL;
+  heap->pages.num_pages = 0;
+  
+  return heap;
+}
+
+static void
+p2fl_heap_destroy(kma_heap_t* heap)
+{
+  free_page_group(&heap->pages);
+  free_page(find_page(heap));
+}
+
+static void*
+p2fl_heap_malloc(kma_heap_t* heap, kma_size_t size)
 {
   return NULL;
 }
 
-void
-kma_free(void* ptr, kma_size_t size)
+static void
+p2fl_heap_free(kma_heap_t* heap, void* ptr, kma_size_t size)
 {
   ;
 }
 
-#endif // KMA_P2FL
+static int
+p2fl_heap_pages(kma_heap_t* heap)
+{
+  return heap->pages.num_pages;
+}
+
+static void
+p2fl_snapshot(char* path)
+{
+  page_snapshot(path, &defaultHeap, sizeof(defaultHeap));
+}
+
+static void
+p2fl_restore(char* path)
+{
+  page_restore(path, &defaultHeap, sizeof(defaultHeap));
+}
+
+kma_ops_t kma_p2fl_ops =
+  {
+    .name         = "p2fl",
+    .default_heap = &defaultHeap,
+    .heap_size    = sizeof(kma_heap_t),
+    .heap_create  = p2fl_heap_create,
+    .heap_destroy = p2fl_heap_destroy,
+    .heap_malloc  = p2fl_heap_malloc,
+    .heap_free    = p2fl_heap_free,
+    .heap_pages   = p2fl_heap_pages,
+    .snapshot     = p2fl_snapshot,
+    .restore      = p2fl_restore
+  };
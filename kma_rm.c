@@ -31,7 +31,6 @@
  *    - initial version for the kernel memory allocator project
  *
  ***************************************************************************/
-#ifdef KMA_RM
 #define __KMA_IMPL__
 
 /************System include***********************************************/
@@ -61,8 +60,17 @@ typedef struct blockT
   bool used;
 } block_t;
 
+/* the block list of a heap starts in its first page; a heap made by
+ * kma_heap_create() sits at the start of a zeroed page of its own, which
+ * is an empty heap */
+struct kma_heap
+{
+  kma_page_group_t pages;
+  kma_page_t* firstPage;
+};
+
 /************Global Variables*********************************************/
-static kma_page_t* firstPage = NULL;
+static kma_heap_t defaultHeap;
 /************Function Prototypes******************************************/
 
 /***********************************************************************
@@ -83,6 +91,17 @@ int CalcBlockSize(block_t*);
  ***********************************************************************/
 bool SamePage(block_t*, block_t*);
 
+/***********************************************************************
+ *  Title: Page Head
+ * ---------------------------------------------------------------------
+ *    Purpose: Finds the first block of a page. It starts at the color
+ *             offset of the page, so the first blocks of different
+ *             pages fall into different cache sets
+ *    Input: a pointer into the page
+ *    Output: the first block of the page
+ ***********************************************************************/
+block_t* PageHead(void*);
+
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
@@ -92,6 +111,11 @@ inline bool SamePage(block_t* b1, block_t* b2)
   return BASEADDR(b1) == BASEADDR(b2);
 }
 
+inline block_t* PageHead(void* ptr)
+{
+  return (block_t*)((size_t)BASEADDR(ptr) + PAGECOLOR(ptr));
+}
+
 int CalcBlockSize(block_t* block)
 {
   if(block == NULL)
@@ -109,46 +133,67 @@ size of header */
   return (int)((size_t)endPage - (size_t)block - sizeof(*block));
 }
 
-void*
-kma_malloc(kma_size_t size)
+static kma_heap_t*
+rm_heap_create()
+{
+  kma_page_t* page = get_zeroed_page(PAGE_METADATA);
+  
+  return (kma_heap_t*)page->ptr;
+}
+
+static void
+rm_heap_destroy(kma_heap_t* heap)
+{
+  // the blocks live in the heap's pages, so they go with them
+  free_page_group(&heap->pages);
+  free_page(find_page(heap));
+}
+
+static void*
+rm_heap_malloc(kma_heap_t* heap, kma_size_t size)
 {
 /*This function will scan the LL, looking for the first available free block.
 (first fit). If no free block exsists, it will allocate a new page if necessary. */
 
 
-/* Each page begins w/ a pointer to a corresponding kma_page_t struct*/
+/* The kma_page_t struct of a page is found through find_page(), so the page holds no pointer to it*/
 /* Each block begins w/ a corresponding block_t struct*/
-/* Therefore the total useable memory on any page = size of page - size of (block_t) - sizeof(kma_page_t*)*/ 
+/* Therefore the total useable memory on any page = size of page - color offset - size of (block_t)*/ 
 
-/*A request for more memory than can be supplied by a single page is invalid*/
-  if(size > PAGESIZE - sizeof(block_t) - sizeof(kma_page_t*))
-    return NULL;
+/*A request for more memory than can be supplied by every page gets its own run of pages*/
+  if(size > PAGESIZE - MAXPAGECOLOR - sizeof(block_t))
+  {
+    kma_page_t* run = get_pages((size + PAGESIZE - 1) / PAGESIZE, PAGE_LARGE);
+    if(run == NULL)
+      return NULL;
+    page_group_add(&heap->pages, run);
+    return run->ptr;
+  }
 
 /*If this is the first page we are allocating, we must initalize a first page and a LL to keep track of all subsequent blocks.*/
-  if(firstPage == NULL)
+  if(heap->firstPage == NULL)
   {
    /*get the first page*/
-    firstPage = get_page();
-   /*set a ptr to the corresponding kma_page_t struct at the top of the page*/
-    *((kma_page_t**)firstPage->ptr) = firstPage;
+    heap->firstPage = get_page(PAGE_DATA);
+    page_group_add(&heap->pages, heap->firstPage);
    /*create a new block which also provides an entry into the LL*/
-    block_t* head = (block_t*)((size_t)firstPage->ptr + sizeof(kma_page_t*));
+    block_t* head = PageHead(heap->firstPage->ptr);
     head->prev = NULL;
     head->next = NULL;
     head->used = FALSE;
   }
 
 /*Search the LL for a free block*/
-  block_t* block = (block_t*)((size_t)firstPage->ptr + sizeof(kma_page_t*));
+  block_t* block = PageHead(heap->firstPage->ptr);
   while(block->used || CalcBlockSize(block) < size)
   {
     /*If you reach the end of the LL, there is no free block to be found*/
     /*In this case you must allocate a new page.*/
     if(block->next == NULL)
     {
-      kma_page_t* nextPage = get_page();
-      *((kma_page_t**)nextPage->ptr) = nextPage;
-      block_t* pageHead = (block_t*)((size_t)nextPage->ptr + sizeof(kma_page_t*));
+      kma_page_t* nextPage = get_page(PAGE_DATA);
+      page_group_add(&heap->pages, nextPage);
+      block_t* pageHead = PageHead(nextPage->ptr);
       block->next = pageHead;
       pageHead->prev = block;
       pageHead->next = NULL;
@@ -188,8 +233,8 @@ address= start address of current block+size of header+ size of memory request*/
   return (void*)((size_t)block + sizeof(*block));
 }
 
-void
-kma_free(void* ptr, kma_size_t size)
+static void
+rm_heap_free(kma_heap_t* heap, void* ptr, kma_size_t size)
 {
 
 /*This function frees a block of memory and performs coalescing if necessary*/
@@ -213,6 +258,13 @@ kma_free(void* ptr, kma_size_t size)
   if(ptr == NULL)
     return;
 
+/*Large requests were served by a run of pages, which holds no blocks*/
+  if(size > PAGESIZE - MAXPAGECOLOR - sizeof(block_t))
+  {
+    free_page(find_page(ptr));
+    return;
+  }
+
   /*set curBlock to point to the top of the block*/
   /*top of block = start of useable memory - size of header*/
 
@@ -259,18 +311,18 @@ kma_free(void* ptr, kma_size_t size)
 
    //Used-Used Case: cannot coalesce 
  
-  // There will always be a block_t struct at the beginning of any
+  // There will always be a block_t struct at the color offset of any
   // page.
-  block_t* base = (block_t*)((size_t)BASEADDR(curBlock) + sizeof(kma_page_t*));
+  block_t* base = PageHead(curBlock);
   
-  if(CalcBlockSize(base) >= PAGESIZE - sizeof(*base) - sizeof(kma_page_t*))
+  if(CalcBlockSize(base) >= PAGESIZE - PAGECOLOR(base) - sizeof(*base))
   {
-    if(base == (block_t*)((size_t)firstPage->ptr + sizeof(kma_page_t*)))
+    if(base == PageHead(heap->firstPage->ptr))
     {
       if(base->next == NULL)
-        firstPage = NULL;
+        heap->firstPage = NULL;
       else
-        firstPage = *((kma_page_t**)BASEADDR(base->next));
+        heap->firstPage = find_page(base->next);
     }
     
     if(base->prev != NULL)
@@ -279,8 +331,39 @@ kma_free(void* ptr, kma_size_t size)
     if(base->next != NULL)
       base->next->prev = base->prev;
     
-    free_page(*((kma_page_t**)BASEADDR(curBlock)));
+    free_page(find_page(curBlock));
   }
 }
 
-#endif // KMA_RM
+static int
+rm_heap_pages(kma_heap_t* heap)
+{
+  return heap->pages.num_pages;
+}
+
+static void
+rm_snapshot(char* path)
+{
+  // the block lists link through the pages, which keep their addresses
+  page_snapshot(path, &defaultHeap, sizeof(defaultHeap));
+}
+
+static void
+rm_restore(char* path)
+{
+  page_restore(path, &defaultHeap, sizeof(defaultHeap));
+}
+
+kma_ops_t kma_rm_ops =
+  {
+    .name         = "rm",
+    .default_heap = &defaultHeap,
+    .heap_size    = sizeof(kma_heap_t),
+    .heap_create  = rm_heap_create,
+    .heap_destroy = rm_heap_destroy,
+    .heap_malloc  = rm_heap_malloc,
+    .heap_free    = rm_heap_free,
+    .heap_pages   = rm_heap_pages,
+    .snapshot     = rm_snapshot,
+    .restore      = rm_restore
+  };
@@ -56,6 +56,23 @@
 	#define MAX_SIZE 8000
 	#define PROB_OVERSIZED 0.02
 
+	// the algorithm the harness is built for
+	#if defined(KMA_DUMMY)
+	#define ALG kma_dummy_ops
+	#elif defined(KMA_RM)
+	#define ALG kma_rm_ops
+	#elif defined(KMA_P2FL)
+	#define ALG kma_p2fl_ops
+	#elif defined(KMA_MCK2)
+	#define ALG kma_mck2_ops
+	#elif defined(KMA_BUD)
+	#define ALG kma_bud_ops
+	#elif defined(KMA_LZBUD)
+	#define ALG kma_lzbud_ops
+	#else
+	#error "define one of KMA_DUMMY, KMA_RM, KMA_P2FL, KMA_MCK2, KMA_BUD, KMA_LZBUD"
+	#endif
+
 	typedef struct mem
 	{
 		int size;
@@ -69,6 +86,8 @@
 	static mem_t* first = NULL;
 	static int size = 0;
 	static int val = 0;
+
+	kma_ops_t* kma_alg = &ALG;
 	
   /************Function Prototypes******************************************/
 	float frand();
@@ -155,8 +174,9 @@ void allocate()
 
 	new->ptr = kma_malloc(new->size);
 
-	assert(((new->ptr != NULL) && (new->size <= MAX_SIZE))
-		   || ((new->ptr == NULL) && (new->size > MAX_SIZE)));
+	// only a request no run of pages can hold may get NULL
+	assert((new->ptr != NULL)
+		   || (new->size > MAXRUNPAGES * PAGESIZE - sizeof(void*)));
 	
 	if (new->ptr == NULL)
 	{
@@ -217,6 +237,46 @@ void deallocate()
 	free(cur);
 }
 
+void* kma_malloc(kma_size_t size)
+{
+	return kma_alg->heap_malloc(kma_alg->default_heap, size);
+}
+
+void kma_free(void* ptr, kma_size_t size)
+{
+	kma_alg->heap_free(kma_alg->default_heap, ptr, size);
+}
+
+kma_heap_t* kma_heap_create()
+{
+	return kma_alg->heap_create();
+}
+
+void kma_heap_destroy(kma_heap_t* heap)
+{
+	kma_alg->heap_destroy(heap);
+}
+
+void* kma_heap_malloc(kma_heap_t* heap, kma_size_t size)
+{
+	return kma_alg->heap_malloc(heap, size);
+}
+
+void kma_heap_free(kma_heap_t* heap, void* ptr, kma_size_t size)
+{
+	kma_alg->heap_free(heap, ptr, size);
+}
+
+void kma_snapshot(char* path)
+{
+	kma_alg->snapshot(path);
+}
+
+void kma_restore(char* path)
+{
+	kma_alg->restore(path);
+}
+
 void fill(char* ptr, int size)
 {
 	int i;
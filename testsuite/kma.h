@@ -65,8 +65,43 @@
 
 typedef int kma_size_t;
 
+/* A heap holds the state of one instance of the algorithm; each
+ * algorithm defines what is in it. kma_malloc() and kma_free() use a
+ * default heap of their own.
+ */
+typedef struct kma_heap kma_heap_t;
+
+/* The operations of one algorithm. Every kma_*.c exports a table of
+ * its own, so one binary holds all of them; kma_malloc() and the other
+ * functions below call those of kma_alg.
+ */
+typedef struct kma_ops
+{
+  char* name;
+  kma_heap_t* default_heap;  // the heap of kma_malloc() and kma_free()
+  int heap_size;             // a heap of this many zero bytes is empty
+  kma_heap_t* (*heap_create)();
+  void (*heap_destroy)(kma_heap_t*);
+  void* (*heap_malloc)(kma_heap_t*, kma_size_t);
+  void (*heap_free)(kma_heap_t*, void*, kma_size_t);
+  int (*heap_pages)(kma_heap_t*);  // the pages the heap holds
+  void (*snapshot)(char*);
+  void (*restore)(char*);
+} kma_ops_t;
+
 /************Global Variables*********************************************/
 
+// defined by their own files, so declared extern in all of them
+extern kma_ops_t kma_dummy_ops;
+extern kma_ops_t kma_rm_ops;
+extern kma_ops_t kma_p2fl_ops;
+extern kma_ops_t kma_mck2_ops;
+extern kma_ops_t kma_bud_ops;
+extern kma_ops_t kma_lzbud_ops;
+
+// the selected algorithm
+extern kma_ops_t* kma_alg;
+
 /************Function Prototypes******************************************/
 
 /***********************************************************************
@@ -91,6 +126,67 @@ EXTERN void* kma_malloc(kma_size_t size);
  ***********************************************************************/
 EXTERN void kma_free(void*, kma_size_t size);
 
+/***********************************************************************
+ *  Title: Creates a kernel memory heap
+ * ---------------------------------------------------------------------
+ *    Purpose: Creates an empty heap, independent of every other heap.
+ *             A heap is used by one thread at a time.
+ *    Input: none
+ *    Output: the heap
+ ***********************************************************************/
+EXTERN kma_heap_t* kma_heap_create();
+
+/***********************************************************************
+ *  Title: Destroys a kernel memory heap
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases every page of the heap, whatever is still
+ *             allocated from it, in time linear in its pages
+ *    Input: the heap
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kma_heap_destroy(kma_heap_t*);
+
+/***********************************************************************
+ *  Title: Allocates kernel memory from a heap
+ * ---------------------------------------------------------------------
+ *    Purpose: Like kma_malloc(), from the given heap
+ *    Input: the heap, the size
+ *    Output: the allocated memory of the specified size
+ *            or NULL on failure
+ ***********************************************************************/
+EXTERN void* kma_heap_malloc(kma_heap_t*, kma_size_t size);
+
+/***********************************************************************
+ *  Title: Frees kernel memory to a heap
+ * ---------------------------------------------------------------------
+ *    Purpose: Like kma_free(), for memory allocated from the given heap
+ *    Input: the heap, the pointer to the memory space, the size of the
+ *           memory space
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kma_heap_free(kma_heap_t*, void*, kma_size_t size);
+
+/***********************************************************************
+ *  Title: Saves the kernel memory heap
+ * ---------------------------------------------------------------------
+ *    Purpose: Writes the page pool and the default heap, its pages
+ *             and the allocator's bookkeeping, to a file
+ *    Input: the file name
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kma_snapshot(char* path);
+
+/***********************************************************************
+ *  Title: Restores the kernel memory heap
+ * ---------------------------------------------------------------------
+ *    Purpose: Replaces the empty heap with one saved by
+ *             kma_snapshot(), so the memory allocated when it was
+ *             saved is allocated again, at the same addresses
+ *    Input: the file name
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kma_restore(char* path);
+
 /************External Declaration*****************************************/
 
 /**************Definition***************************************************/
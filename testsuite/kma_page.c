@@ -41,10 +41,22 @@
 
 /************System include***********************************************/
 #include <assert.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -57,124 +69,2767 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+#define BITSPERWORD (8 * sizeof(unsigned long))
+
+#define BITMAPWORDS (EXTENTPAGES / BITSPERWORD)
+
+#define TESTBIT(map, i) ((map)[(i) / BITSPERWORD] & (1UL << ((i) % BITSPERWORD)))
+#define SETBIT(map, i) ((map)[(i) / BITSPERWORD] |= (1UL << ((i) % BITSPERWORD)))
+#define CLEARBIT(map, i) ((map)[(i) / BITSPERWORD] &= ~(1UL << ((i) % BITSPERWORD)))
+
+// the size of a transparent huge page, extents are a multiple of it
+#define THPSIZE (2L * 1024 * 1024)
+
+// logical pages in a transparent huge page
+#define THPPAGES ((int) (THPSIZE / PAGESIZE))
+
+// transparent huge pages in an extent of the largest pages
+#define MAXEXTENTTHPS ((int) (EXTENTPAGES / (THPSIZE / MAXPAGESIZE)))
+
+/* Every free page of an extent is marked in the out-of-line free
+ * bitmap, which is what contiguous runs are searched in. Pages at or
+ * above bump have never been handed out and are not touched until
+ * they are. Recycled resident free pages are additionally marked in the
+ * idle bitmap, and purged pages, which have lost their contents, in the
+ * purged bitmap. Freeing a page therefore never writes into it, and a
+ * summary word with one bit per non-empty idle word finds the lowest
+ * idle page with two find-first-set operations. Free pages that are
+ * known to be zero are kept apart from the idle ones in the zeroed
+ * bitmap, for get_zeroed_page(). The idle pages in each transparent
+ * huge page are counted, so that an extent without a wholly idle one is
+ * not scanned for purging.
+ */
+typedef struct extent
+{
+  void* base;
+  int num_in_use;
+  int num_free;
+  int num_purged;
+  int bump;
+  long empty_since;
+  kma_backing_t backing;
+  unsigned long free[BITMAPWORDS];
+  unsigned long idle[BITMAPWORDS];
+  unsigned long idle_summary;
+  short thp_idle[MAXEXTENTTHPS];
+  int num_idle_thps;
+  unsigned long purged[BITMAPWORDS];
+  unsigned long zeroed[BITMAPWORDS];
+  int num_zeroed;
+  struct extent* prev;
+  struct extent* next;
+  struct extent* older;
+  struct extent* newer;
+} kma_extent_t;
+
+/* A thread keeps up to PAGECACHESIZE free pages for itself, and its
+ * own page counters, so the common get_page()/free_page() touches no
+ * shared state. The counters are only written by the owning thread.
+ */
+typedef struct cache
+{
+  int registered;
+  int count;
+  void* pages[PAGECACHESIZE];
+  int next_id;
+  int num_requested;
+  int num_freed;
+  int until_drain;
+  struct cache* next;
+} kma_cache_t;
+
+/* the depot head packs a generation tag above the page index plus one,
+ * so a pop can not succeed against a head that was popped and pushed
+ * again in between (ABA)
+ */
+#define DEPOTINDEX(head) ((unsigned int) ((head) & 0xffffffffUL))
+#define DEPOTHEAD(tag, index) ((((unsigned long) (tag)) << 32) | (index))
+
+/* Everything the pool shares between the threads of a process. A pool
+ * shared with page_share() keeps it at the start of the shared segment
+ * instead, and since every process maps the segment at the same
+ * address, the pointers in it are valid in all of them.
+ */
+typedef struct
+{
+  // where the shared segment is mapped, and its size
+  void* base;
+  long size;
+  bool shared;
+  int ready;
+  int page_colors;
+  
+  // protects everything below except the depot
+  pthread_mutex_t pool_lock;
+  
+  // the root of the heap the processes sharing the pool allocate from,
+  // reserved in the segment, and the lock they use it under
+  void* root;
+  pthread_mutex_t root_lock;
+  
+  kma_page_stat_t kma_page_stats;
+  
+  // the reserved address space; extent i lives at pool + i * EXTENTSIZE
+  void* pool;
+  
+  // the page descriptors, indexed by (ptr - pool) / PAGESIZE
+  kma_page_t* pages;
+  
+  // the extent table; a slot whose base is NULL is not committed
+  kma_extent_t extents[MAXEXTENTS];
+  int num_extent_slots;
+  int max_extents;
+  
+  // extents that still have at least one free page; empty extents that
+  // are retained go to the tail so the others are filled first
+  kma_extent_t* partial_extents;
+  kma_extent_t* partial_tail;
+  
+  // empty extents are retained while fewer than retain_pages pages
+  // would stay committed without them, or for retain_idle_ms after
+  // emptying
+  int retain_pages;
+  int retain_idle_ms;
+  int num_empty;
+  
+  // the empty extents in the order they emptied, linked through older
+  // and newer, so only the oldest has to be checked for expiry
+  kma_extent_t* oldest_empty;
+  kma_extent_t* newest_empty;
+  
+  kma_purge_policy_t purge_policy;
+  int purge_idle_pages;
+  int purge_advice;
+  // once a page was purged with MADV_FREE, purged pages may keep their
+  // contents and are no longer known to be zero
+  bool lazy_purged;
+  
+  kma_backing_t backing;
+  
+  // resident free pages over all extents
+  int num_idle;
+  
+  // wholly idle transparent huge pages over all extents
+  int num_idle_thps;
+  
+  // pages above the bump pointers of all extents
+  int num_untouched;
+  
+  // the counters of exited threads
+  int retired_requested;
+  int retired_freed;
+  
+  // pages in use per purpose, and the most there ever were; these are
+  // updated by every thread, so the peak is a true high-water mark
+  int num_tagged[NUMPURPOSES];
+  int max_tagged[NUMPURPOSES];
+  
+  // the counters of all processes sharing the pool, which do not
+  // cache pages
+  kma_cache_t shared_cache;
+  
+  // the lock-free stack of free pages shared by all thread caches,
+  // linked through depot_next by page index plus one
+  unsigned long depot_head;
+  int depot_count;
+  unsigned int* depot_next;
+} kma_pool_t;
+
+/* A snapshot file starts with this header, the pool state and the
+ * allocator's root, followed by the descriptors and the used pages of
+ * every extent slot up to the highest committed one, at the offsets
+ * they have from pages and pool, so each extent can be mapped straight
+ * from the file. The allocators keep plain pointers in their pages and
+ * roots, so the pages are restored at the addresses they were saved
+ * from; only the pointers into the pool state itself are relocated.
+ */
+#define SNAPSHOTMAGIC "KMASNAP1"
+
+typedef struct
+{
+  char magic[8];
+  kma_pool_t* state;
+  void* root;
+  int page_size;
+  int page_colors;
+  int num_requested;
+  int num_freed;
+  int num_tagged[NUMPURPOSES];
+  int root_size;
+  long pages_at;
+  long pool_at;
+} kma_snapshot_t;
+
 /************Global Variables*********************************************/
-static kma_page_stat_t kma_page_stats = { 0, 0, 0, PAGESIZE };
+int gPageSize = DEFAULTPAGESIZE;
+int gPageShift = __builtin_ctz(DEFAULTPAGESIZE);
+long gPageMask = ~((long) DEFAULTPAGESIZE - 1);
+int gPageColors = DEFAULTPAGECOLORS;
+
+static kma_pool_t private_pool =
+{
+  .pool_lock        = PTHREAD_MUTEX_INITIALIZER,
+  .root_lock        = PTHREAD_MUTEX_INITIALIZER,
+  .kma_page_stats   = { .page_size = DEFAULTPAGESIZE, .backing = BACKING_SMALL },
+  .max_extents      = MAXEXTENTS,
+  .retain_pages     = RETAINPAGES,
+  .retain_idle_ms   = RETAINIDLEMS,
+  .purge_policy     = PURGE_IDLE,
+  .purge_idle_pages = PURGEIDLEPAGES,
+  .purge_advice     = MADV_DONTNEED,
+  .backing          = BACKING_SMALL,
+};
+
+/* the pool in use, the private one until page_share() */
+static kma_pool_t* state = &private_pool;
+
+/* the caches of all live threads of this process */
+static kma_cache_t* caches = NULL;
+
+static __thread kma_cache_t thread_cache;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
 
-static void* pool = NULL;
-static void* next_free_page = NULL;
+/* the name of a shared pool this process created, which it unlinks
+ * when it exits, and the descriptor that holds its lock on the pool
+ */
+static char shared_name[NAME_MAX + 1];
+static pid_t shared_creator = 0;
+static int shared_fd = -1;
 
 /************Function Prototypes******************************************/
+kma_cache_t* getCache();
+void createCacheKey();
+void retireCache(void*);
+void* cachePop(kma_cache_t*);
+void cachePush(kma_cache_t*, void*);
+void drainCache(kma_cache_t*);
+void trimCache(kma_cache_t*);
+bool overRetained(int*);
+void* depotPop();
+bool depotPush(void*);
+void countPages(int*, int);
+void countTagged(kma_purpose_t, int);
 void* allocPage();
-void freePage(void*);
-void initPages();
+void* allocZeroedPage();
+void* takePage(kma_extent_t*, int);
+void queueZeroed(void*);
+void zeroPage(void*);
+int lowestBit(unsigned long*);
+void* allocRun(int);
+void freeRun(void*, int);
+kma_page_t* describePage(kma_cache_t*, void*, int, kma_purpose_t);
+void reservePool();
+void unreservePool();
+void* reserveAligned(long);
+kma_pool_t* createShared(int);
+kma_pool_t* attachShared(int);
+bool lockShared(int, short, bool);
+void unlinkShared();
+void writeSnapshot(int, void*, long, long);
+void readSnapshot(int, void*, long, long);
+void* mapSnapshot(void*, long, int, int, long);
+void unlinkGroup(kma_page_t*);
+kma_extent_t* addExtent();
+void removeExtent(kma_extent_t*);
+void commitExtent(kma_extent_t*);
+void decommitExtent(kma_extent_t*);
+kma_extent_t* findExtent(void*);
+void linkExtent(kma_extent_t*);
+void linkExtentTail(kma_extent_t*);
+void emptyExtent(kma_extent_t*);
+void fillExtent(kma_extent_t*);
+void linkEmpty(kma_extent_t*);
+void unlinkEmpty(kma_extent_t*);
+void sweepExtents(bool);
+long now();
+void unlinkExtent(kma_extent_t*);
+void initPages(kma_extent_t*);
+int findRun(kma_extent_t*, int);
+int firstUsed(kma_extent_t*, int, int);
+void markIdle(kma_extent_t*, int);
+void unmarkIdle(kma_extent_t*, int);
+int lowestIdle(kma_extent_t*);
+int highestIdle(kma_extent_t*);
+int purgeIdle(int);
+int purgeExtent(kma_extent_t*, int);
+int purgeHugePages(kma_extent_t*, int);
+void purgeRun(void*, int);
 
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
 
 kma_page_t*
-get_page()
+get_page(kma_purpose_t purpose)
+{
+  return get_pages(1, purpose);
+}
+
+void
+free_page(kma_page_t* ptr)
+{
+  free_pages(ptr);
+}
+
+kma_page_t*
+get_pages(int n, kma_purpose_t purpose)
 {
-  static int id = 0;
-  kma_page_t* res;
+  kma_cache_t* cache;
+  void* ptr;
+  
+  assert(n > 0);
+  
+  if (n > MAXRUNPAGES)
+    {
+      return NULL;
+    }
   
-  kma_page_stats.num_requested++;
-  kma_page_stats.num_in_use++;
+  cache = getCache();
+  
+  if (n == 1)
+    {
+      ptr = cachePop(cache);
+    }
+  else
+    {
+      pthread_mutex_lock(&state->pool_lock);
+      ptr = allocRun(n);
+      pthread_mutex_unlock(&state->pool_lock);
+    }
   
-  res = (kma_page_t*) malloc(sizeof(kma_page_t));
-  res->id = id++;
-  res->size = kma_page_stats.page_size;
-  res->ptr = allocPage();
+  assert(ptr != NULL);
   
-  assert(res->ptr != NULL);
+  countPages(&cache->num_requested, n);
+  countTagged(purpose, n);
   
-  return res;	
+  return describePage(cache, ptr, n, purpose);
 }
 
 void
-free_page(kma_page_t* ptr)
+free_pages(kma_page_t* ptr)
 {
+  kma_cache_t* cache;
+  void* page;
+  int n;
+  
   assert(ptr != NULL);
   assert(ptr->ptr != NULL);
-  assert(kma_page_stats.num_in_use > 0);
   
-  kma_page_stats.num_freed++;
-  kma_page_stats.num_in_use--;
+  cache = getCache();
+  page = ptr->ptr;
+  n = ptr->size / PAGESIZE;
+  ptr->ptr = NULL;
+  unlinkGroup(ptr);
+  
+  countPages(&cache->num_freed, n);
+  countTagged(ptr->purpose, -n);
+  
+  if (n == 1)
+    {
+      cachePush(cache, page);
+    }
+  else
+    {
+      pthread_mutex_lock(&state->pool_lock);
+      freeRun(page, n);
+      pthread_mutex_unlock(&state->pool_lock);
+    }
+  
+  trimCache(cache);
+}
+
+kma_page_t*
+get_zeroed_page(kma_purpose_t purpose)
+{
+  kma_cache_t* cache = getCache();
+  void* ptr;
+  
+  // cached pages are dirty, so this always goes to the extents
+  pthread_mutex_lock(&state->pool_lock);
+  ptr = allocZeroedPage();
+  pthread_mutex_unlock(&state->pool_lock);
+  
+  countPages(&cache->num_requested, 1);
+  countTagged(purpose, 1);
+  
+  return describePage(cache, ptr, 1, purpose);
+}
+
+int
+get_pages_batch(int n, kma_page_t* out[], kma_purpose_t purpose)
+{
+  kma_cache_t* cache;
+  void* page;
+  int i = 0;
+  
+  assert(n >= 0);
+  
+  cache = getCache();
+  
+  // drain the thread cache and the depot before taking the lock once
+  // for the rest
+  while (i < n && cache->count > 0)
+    {
+      out[i++] = describePage(cache, cache->pages[--cache->count], 1, purpose);
+    }
+  
+  while (i < n && (page = depotPop()) != NULL)
+    {
+      out[i++] = describePage(cache, page, 1, purpose);
+    }
+  
+  if (i < n)
+    {
+      pthread_mutex_lock(&state->pool_lock);
+      
+      while (i < n)
+	{
+	  out[i++] = describePage(cache, allocPage(), 1, purpose);
+	}
+      
+      pthread_mutex_unlock(&state->pool_lock);
+    }
+  
+  countPages(&cache->num_requested, n);
+  countTagged(purpose, n);
+  
+  return n;
+}
+
+void
+free_pages_batch(kma_page_t* batch[], int n)
+{
+  kma_cache_t* cache;
+  int tagged[NUMPURPOSES] = { 0 };
+  int i, total = 0, rest = 0;
+  
+  cache = getCache();
+  
+  // single pages go to the thread cache while it has room, everything
+  // else back to the extents under one lock
+  for (i = 0; i < n; i++)
+    {
+      assert(batch[i] != NULL);
+      assert(batch[i]->ptr != NULL);
+      
+      unlinkGroup(batch[i]);
+      total += batch[i]->size / PAGESIZE;
+      tagged[batch[i]->purpose] += batch[i]->size / PAGESIZE;
+      
+      if (batch[i]->size == PAGESIZE && !state->shared
+	  && cache->count < PAGECACHESIZE)
+	{
+	  cache->pages[cache->count++] = batch[i]->ptr;
+	  batch[i]->ptr = NULL;
+	}
+      else
+	{
+	  rest++;
+	}
+    }
+  
+  countPages(&cache->num_freed, total);
+  for (i = 0; i < NUMPURPOSES; i++)
+    {
+      if (tagged[i] != 0)
+	{
+	  countTagged(i, -tagged[i]);
+	}
+    }
+  
+  if (rest > 0)
+    {
+      pthread_mutex_lock(&state->pool_lock);
+      
+      for (i = 0; i < n; i++)
+	{
+	  if (batch[i]->ptr != NULL)
+	    {
+	      freeRun(batch[i]->ptr, batch[i]->size / PAGESIZE);
+	      batch[i]->ptr = NULL;
+	    }
+	}
+      
+      pthread_mutex_unlock(&state->pool_lock);
+    }
+  
+  trimCache(cache);
+}
+
+kma_page_t*
+describePage(kma_cache_t* cache, void* ptr, int n, kma_purpose_t purpose)
+{
+  kma_page_t* res = find_page(ptr);
+  
+  // ids are a sequence number per allocating thread, or per pool when
+  // it is shared
+  if (state->shared)
+    {
+      res->id = __atomic_fetch_add(&cache->next_id, 1, __ATOMIC_RELAXED);
+    }
+  else
+    {
+      res->id = cache->next_id++;
+    }
+  res->ptr = ptr;
+  res->size = n * PAGESIZE;
+  res->purpose = purpose;
+  res->group = NULL;
+  res->group_prev = NULL;
+  res->group_next = NULL;
+  res->owner = NULL;
+  res->size_class = 0;
+  res->free_count = 0;
+  
+  return res;
+}
+
+void
+page_group_add(kma_page_group_t* group, kma_page_t* page)
+{
+  assert(page->group == NULL);
+  
+  page->group = group;
+  page->group_prev = NULL;
+  page->group_next = group->first;
+  
+  if (group->first != NULL)
+    {
+      group->first->group_prev = page;
+    }
+  
+  group->first = page;
+  group->num_pages += page->size / PAGESIZE;
+}
+
+void
+unlinkGroup(kma_page_t* page)
+{
+  kma_page_group_t* group = page->group;
+  
+  if (group == NULL)
+    {
+      return;
+    }
+  
+  if (page->group_prev != NULL)
+    {
+      page->group_prev->group_next = page->group_next;
+    }
+  else
+    {
+      group->first = page->group_next;
+    }
+  
+  if (page->group_next != NULL)
+    {
+      page->group_next->group_prev = page->group_prev;
+    }
+  
+  group->num_pages -= page->size / PAGESIZE;
+  page->group = NULL;
+}
+
+int
+free_page_group(kma_page_group_t* group)
+{
+  kma_page_t* batch[PAGECACHESIZE];
+  kma_page_t* page;
+  int res = group->num_pages;
+  int n;
+  
+  // freeing a page unlinks it, so every batch starts at the head
+  while (group->first != NULL)
+    {
+      n = 0;
+      
+      for (page = group->first; page != NULL && n < PAGECACHESIZE;
+	   page = page->group_next)
+	{
+	  batch[n++] = page;
+	}
+      
+      free_pages_batch(batch, n);
+    }
+  
+  assert(group->num_pages == 0);
+  
+  return res;
+}
+
+kma_page_t*
+find_page(void* ptr)
+{
+  long i = (ptr - state->pool) / PAGESIZE;
+  
+  assert(state->pool != NULL);
+  assert(i >= 0 && i < MAXPAGES);
   
-  freePage(ptr->ptr);
-  free(ptr);
+  return &state->pages[i];
 }
 
 kma_page_stat_t*
 page_stats()
 {
-  static kma_page_stat_t stats;
+  static __thread kma_page_stat_t stats;
+  kma_cache_t* list;
+  kma_cache_t* cache;
+  int requested, freed, t;
+  
+  pthread_mutex_lock(&state->pool_lock);
+  
+  // a shared pool counts for all processes in one place
+  list = state->shared ? &state->shared_cache : caches;
+  
+  requested = state->retired_requested;
+  freed = state->retired_freed;
+  
+  // every counted free was preceded by its request, so reading all
+  // frees before all requests never shows more pages freed than
+  // requested
+  for (cache = list; cache != NULL; cache = cache->next)
+    {
+      freed += __atomic_load_n(&cache->num_freed, __ATOMIC_ACQUIRE);
+    }
+  for (cache = list; cache != NULL; cache = cache->next)
+    {
+      requested += __atomic_load_n(&cache->num_requested, __ATOMIC_ACQUIRE);
+    }
+  
+  state->kma_page_stats.num_requested = requested;
+  state->kma_page_stats.num_freed = freed;
+  state->kma_page_stats.num_in_use = requested - freed;
+  
+  for (t = 0; t < NUMPURPOSES; t++)
+    {
+      state->kma_page_stats.num_tagged[t] = __atomic_load_n(&state->num_tagged[t], __ATOMIC_RELAXED);
+      state->kma_page_stats.max_tagged[t] = __atomic_load_n(&state->max_tagged[t], __ATOMIC_RELAXED);
+    }
+  state->kma_page_stats.resident_bytes = state->kma_page_stats.committed_bytes
+    - (long) (state->kma_page_stats.num_purged + state->num_untouched) * PAGESIZE;
+  
+  memcpy(&stats, &state->kma_page_stats, sizeof(kma_page_stat_t));
   
-  return memcpy(&stats, &kma_page_stats, sizeof(kma_page_stat_t));
+  pthread_mutex_unlock(&state->pool_lock);
+  
+  return &stats;
 }
 
-void*
-allocPage()
+void
+page_purge_policy(kma_purge_policy_t policy, int idle_pages, int lazy)
 {
-  void* res;
+  assert(idle_pages >= 0);
+  
+  pthread_mutex_lock(&state->pool_lock);
+  
+  state->purge_policy = policy;
+  state->purge_idle_pages = idle_pages;
+  // a shared segment only gives memory back when the pages are removed
+  // from it, and that can not be lazy
+  state->purge_advice = state->shared ? MADV_REMOVE : MADV_DONTNEED;
+  
+#ifdef MADV_FREE
+  if (lazy && !state->shared)
+    {
+      state->purge_advice = MADV_FREE;
+    }
+#endif
   
-  if (pool == NULL)
+  if (state->purge_policy == PURGE_IMMEDIATE)
     {
-      initPages();
+      purgeIdle(state->num_idle);
+    }
+  else if (state->purge_policy == PURGE_IDLE && state->num_idle > state->purge_idle_pages)
+    {
+      purgeIdle(state->num_idle - state->purge_idle_pages);
     }
   
-  res = next_free_page;
+  pthread_mutex_unlock(&state->pool_lock);
+}
+
+void
+page_backing(kma_backing_t mode)
+{
+  pthread_mutex_lock(&state->pool_lock);
+  state->backing = mode;
+  pthread_mutex_unlock(&state->pool_lock);
+}
+
+void
+page_geometry(int page_size, long pool_size)
+{
+  long num;
   
-  if (res == NULL)
+  if (page_size < MINPAGESIZE || page_size > MAXPAGESIZE
+      || (page_size & (page_size - 1)) != 0)
     {
-      error("error: all pages already allocated", "");
+      error("invalid page size", "");
     }
   
-  next_free_page = *((void**)next_free_page);
+  num = (pool_size == 0) ? MAXEXTENTS
+    : (pool_size + (long) EXTENTPAGES * page_size - 1)
+    / ((long) EXTENTPAGES * page_size);
+  
+  if (num < 1 || num > MAXEXTENTS)
+    {
+      error("invalid pool size", "");
+    }
   
-  assert(res != NULL);
+  if (state->shared)
+    {
+      error("can not change the geometry of a shared page pool", "");
+    }
   
-  return res;
+  // hand back what the calling thread and the depot still hold, then
+  // every extent must be empty
+  page_release();
+  
+  pthread_mutex_lock(&state->pool_lock);
+  
+  if (state->kma_page_stats.num_extents != 0)
+    {
+      error("can not change the page geometry while pages are in use", "");
+    }
+  
+  if (state->pool != NULL)
+    {
+      unreservePool();
+    }
+  
+  gPageSize = page_size;
+  gPageShift = __builtin_ctz(page_size);
+  gPageMask = ~((long) page_size - 1);
+  state->max_extents = num;
+  state->kma_page_stats.page_size = page_size;
+  
+  pthread_mutex_unlock(&state->pool_lock);
 }
 
 void
-freePage(void* ptr)
+page_coloring(int colors)
 {
-  assert(ptr != NULL);
+  if (colors < 1 || colors > MAXPAGECOLORS || (colors & (colors - 1)) != 0)
+    {
+      error("invalid number of page colors", "");
+    }
   
-  *((void**)ptr) = next_free_page;
-  next_free_page = ptr;
+  if (state->shared)
+    {
+      error("can not change the coloring of a shared page pool", "");
+    }
   
-  if (kma_page_stats.num_in_use == 0)
+  if (page_stats()->num_in_use != 0)
     {
-      free(pool);
-      pool = NULL;
-      next_free_page = NULL;
+      error("can not change the page coloring while pages are in use", "");
     }
+  
+  gPageColors = colors;
 }
 
 void
-initPages()
+page_retain_policy(int min_pages, int idle_ms)
 {
-  int i;
+  kma_cache_t* cache = getCache();
   
-  assert(next_free_page == NULL);
-  assert(pool == NULL);
+  assert(min_pages >= 0 && idle_ms >= 0);
   
-  //pool = calloc(MAXPAGES, PAGESIZE);
-  int result = posix_memalign(&pool, PAGESIZE, MAXPAGES * PAGESIZE);
-  if(result)
-    error("Error using posix_memalign to allocate memory", "");
-  next_free_page = pool;
+  pthread_mutex_lock(&state->pool_lock);
   
-  // use ptr to point to the next free page struct
-  for (i = 0; i < (MAXPAGES - 1); i++)
+  state->retain_pages = min_pages;
+  state->retain_idle_ms = idle_ms;
+  drainCache(cache);
+  sweepExtents(FALSE);
+  
+  pthread_mutex_unlock(&state->pool_lock);
+}
+
+int
+page_release()
+{
+  kma_cache_t* cache = getCache();
+  int res;
+  
+  pthread_mutex_lock(&state->pool_lock);
+  
+  res = state->kma_page_stats.num_releases;
+  drainCache(cache);
+  sweepExtents(TRUE);
+  res = state->kma_page_stats.num_releases - res;
+  
+  pthread_mutex_unlock(&state->pool_lock);
+  
+  return res;
+}
+
+int
+page_purge()
+{
+  int res;
+  
+  pthread_mutex_lock(&state->pool_lock);
+  res = purgeIdle(state->num_idle);
+  pthread_mutex_unlock(&state->pool_lock);
+  
+  return res;
+}
+
+int
+page_prezero(int count)
+{
+  void* batch[BITSPERWORD];
+  kma_extent_t* extent;
+  kma_extent_t* next;
+  int zeroed = 0;
+  int i, n;
+  
+  do
     {
-      void* ptr = (pool + i * PAGESIZE);
-      void* next = ptr + PAGESIZE;
+      n = 0;
+      
+      // take the highest idle pages as if they were allocated, so the
+      // lock is not held while they are cleared
+      pthread_mutex_lock(&state->pool_lock);
+      
+      for (extent = state->partial_extents;
+	   extent != NULL && n < BITSPERWORD && zeroed + n < count;
+	   extent = next)
+	{
+	  // taking the last free page unlinks the extent
+	  next = extent->next;
+	  
+	  while (extent->num_free > 0 && n < BITSPERWORD && zeroed + n < count)
+	    {
+	      int index = highestIdle(extent);
+	      
+	      fillExtent(extent);
+	      unmarkIdle(extent, index);
+	      batch[n++] = takePage(extent, index);
+	    }
+	}
+      
+      pthread_mutex_unlock(&state->pool_lock);
+      
+      for (i = 0; i < n; i++)
+	{
+	  zeroPage(batch[i]);
+	}
+      
+      pthread_mutex_lock(&state->pool_lock);
       
-      *((void**) ptr) = next;
+      for (i = 0; i < n; i++)
+	{
+	  queueZeroed(batch[i]);
+	}
+      
+      pthread_mutex_unlock(&state->pool_lock);
+      
+      zeroed += n;
     }
+  while (n == BITSPERWORD && zeroed < count);
+  
+  return zeroed;
+}
+
+void
+page_share(char* name)
+{
+  kma_pool_t* shared = NULL;
+  int fd;
   
-  *((void**)(pool + (MAXPAGES - 1) * PAGESIZE)) = NULL;
+  if (state->shared)
+    {
+      error("the page pool is already shared", "");
+    }
+  
+  // the private pool is given up, so it must be empty
+  page_release();
+  
+  if (page_stats()->num_in_use != 0)
+    {
+      error("can not share the page pool while pages are in use", "");
+    }
+  
+  if (name == NULL)
+    {
+      fd = memfd_create("kma_pool", MFD_CLOEXEC);
+      if (fd < 0)
+	{
+	  error("Error using memfd_create to create the shared page pool", "");
+	}
+      
+      shared = createShared(fd);
+    }
+  else
+    {
+      if (strlen(name) > NAME_MAX)
+	{
+	  error("the name of the shared page pool is too long", name);
+	}
+      
+      fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+      if (fd < 0)
+	{
+	  error("Error using shm_open to open the shared page pool", name);
+	}
+      
+      // every process using the pool holds a read lock on it until it
+      // exits. Whoever gets the write lock is alone with the segment:
+      // it is new, or left behind by processes that are gone, whose
+      // counters and lock must not be trusted, so it is set up afresh
+      if (lockShared(fd, F_WRLCK, FALSE))
+	{
+	  if (ftruncate(fd, 0) != 0)
+	    {
+	      error("Error clearing the shared page pool", name);
+	    }
+	  
+	  shared = createShared(fd);
+	  
+	  strcpy(shared_name, name);
+	  if (shared_creator == 0)
+	    {
+	      atexit(unlinkShared);
+	    }
+	  shared_creator = getpid();
+	  
+	  // turning the write lock into a read lock is atomic
+	  lockShared(fd, F_RDLCK, TRUE);
+	}
+      else
+	{
+	  // waits for the creator to set the pool up
+	  lockShared(fd, F_RDLCK, TRUE);
+	  shared = attachShared(fd);
+	}
+    }
+  
+  // the descriptor of a named pool holds the lock, and is inherited by
+  // forked children along with it
+  if (name == NULL)
+    {
+      close(fd);
+    }
+  else
+    {
+      shared_fd = fd;
+    }
+  
+  pthread_mutex_lock(&state->pool_lock);
+  
+  if (state->pool != NULL)
+    {
+      unreservePool();
+    }
+  
+  pthread_mutex_unlock(&state->pool_lock);
+  
+  state = shared;
+}
+
+void*
+page_root(int size)
+{
+  if (size > ROOTSIZE)
+    {
+      error("the root does not fit in the room reserved for it", "");
+    }
+  
+  return state->shared ? state->root : NULL;
+}
+
+void
+page_root_lock()
+{
+  pthread_mutex_lock(&state->root_lock);
+}
+
+void
+page_root_unlock()
+{
+  pthread_mutex_unlock(&state->root_lock);
+}
+
+kma_pool_t*
+createShared(int fd)
+{
+  long num_pages = (long) state->max_extents * EXTENTPAGES;
+  long root_at, pages_at, depot_at, pool_at, size;
+  pthread_mutexattr_t attr;
+  kma_pool_t* shared;
+  void* base;
+  
+  // the state, the root, the page descriptors, the depot links and the
+  // extents, with the extents aligned to their size
+  root_at = (sizeof(kma_pool_t) + CACHELINESIZE - 1) & ~((long) CACHELINESIZE - 1);
+  pages_at = (root_at + ROOTSIZE + MAXPAGESIZE - 1) & ~((long) MAXPAGESIZE - 1);
+  depot_at = pages_at + ((num_pages * sizeof(kma_page_t) + MAXPAGESIZE - 1)
+			 & ~((long) MAXPAGESIZE - 1));
+  pool_at = (depot_at + num_pages * sizeof(unsigned int) + EXTENTSIZE - 1)
+    & ~((long) EXTENTSIZE - 1);
+  size = pool_at + (long) state->max_extents * EXTENTSIZE;
+  
+  if (ftruncate(fd, size) != 0)
+    {
+      error("Error sizing the shared page pool", "");
+    }
+  
+  base = reserveAligned(size);
+  if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0)
+      != base)
+    {
+      error("Error using mmap to map the shared page pool", "");
+    }
+  
+  // the segment is zero, so only what is not has to be set
+  shared = (kma_pool_t*) base;
+  shared->base = base;
+  shared->size = size;
+  shared->shared = TRUE;
+  shared->page_colors = gPageColors;
+  shared->kma_page_stats.page_size = PAGESIZE;
+  shared->kma_page_stats.backing = BACKING_SMALL;
+  shared->root = base + root_at;
+  shared->pool = base + pool_at;
+  shared->pages = (kma_page_t*) (base + pages_at);
+  shared->depot_next = (unsigned int*) (base + depot_at);
+  shared->max_extents = state->max_extents;
+  shared->retain_pages = state->retain_pages;
+  shared->retain_idle_ms = state->retain_idle_ms;
+  shared->purge_policy = state->purge_policy;
+  shared->purge_idle_pages = state->purge_idle_pages;
+  shared->purge_advice = MADV_REMOVE;
+  shared->backing = BACKING_SMALL;
+  
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutex_init(&shared->pool_lock, &attr);
+  pthread_mutex_init(&shared->root_lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  
+  __atomic_store_n(&shared->ready, TRUE, __ATOMIC_RELEASE);
+  
+  return shared;
+}
+
+kma_pool_t*
+attachShared(int fd)
+{
+  kma_pool_t* head;
+  kma_pool_t* shared;
+  struct stat st;
+  
+  // the creator set the segment up before it let go of its write
+  // lock, unless it died half way
+  if (fstat(fd, &st) != 0)
+    {
+      error("Error using fstat on the shared page pool", "");
+    }
+  
+  head = (st.st_size < sizeof(kma_pool_t)) ? MAP_FAILED
+    : mmap(NULL, sizeof(kma_pool_t), PROT_READ, MAP_SHARED, fd, 0);
+  if (head == MAP_FAILED || !__atomic_load_n(&head->ready, __ATOMIC_ACQUIRE))
+    {
+      error("the shared page pool was left half set up", "");
+    }
+  
+  // the pointers in the segment are only valid at the creator's address
+  shared = mmap(head->base, head->size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+  if (shared != head->base)
+    {
+      error("can not map the shared page pool at its address", "");
+    }
+  
+  munmap(head, sizeof(kma_pool_t));
+  
+  gPageSize = shared->kma_page_stats.page_size;
+  gPageShift = __builtin_ctz(gPageSize);
+  gPageMask = ~((long) gPageSize - 1);
+  gPageColors = shared->page_colors;
+  
+  return shared;
+}
+
+bool
+lockShared(int fd, short type, bool wait)
+{
+  struct flock lock;
+  
+  // an open file description lock belongs to the descriptor, not to
+  // the process, and is released when the last copy of it is closed
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = type;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = 0;
+  lock.l_len = 1;
+  
+  if (fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &lock) == 0)
+    {
+      return TRUE;
+    }
+  
+  if (!wait && (errno == EAGAIN || errno == EACCES))
+    {
+      return FALSE;
+    }
+  
+  error("Error locking the shared page pool", "");
+  return FALSE;
+}
+
+void
+unlinkShared()
+{
+  // forked children inherit the exit handler, but not the pool's name
+  if (getpid() == shared_creator)
+    {
+      shm_unlink(shared_name);
+    }
+}
+
+void
+page_snapshot(char* path, void* root, int size)
+{
+  pthread_mutex_t unlocked = PTHREAD_MUTEX_INITIALIZER;
+  kma_page_stat_t* stats;
+  kma_snapshot_t header;
+  long pages_at, pool_at, slice;
+  int fd, i;
+  
+  if (state->shared)
+    {
+      error("can not take a snapshot of a shared page pool", "");
+    }
+  
+  // pages parked in a cache or the depot would be lost
+  page_release();
+  stats = page_stats();
+  
+  fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0)
+    {
+      error("Error creating the snapshot file", path);
+    }
+  
+  pthread_mutex_lock(&state->pool_lock);
+  
+  // only the slots up to the highest committed extent take room
+  slice = (long) EXTENTPAGES * sizeof(kma_page_t);
+  pages_at = (sizeof(kma_snapshot_t) + sizeof(kma_pool_t) + size
+	      + MAXPAGESIZE - 1) & ~((long) MAXPAGESIZE - 1);
+  pool_at = (pages_at + state->num_extent_slots * slice + MAXPAGESIZE - 1)
+    & ~((long) MAXPAGESIZE - 1);
+  
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOTMAGIC, sizeof(header.magic));
+  header.state = state;
+  header.root = root;
+  header.page_size = PAGESIZE;
+  header.page_colors = gPageColors;
+  header.num_requested = stats->num_requested;
+  header.num_freed = stats->num_freed;
+  memcpy(header.num_tagged, stats->num_tagged, sizeof(header.num_tagged));
+  header.root_size = size;
+  header.pages_at = pages_at;
+  header.pool_at = pool_at;
+  
+  // the state is saved while its lock is held, but without it
+  writeSnapshot(fd, &header, sizeof(header), 0);
+  writeSnapshot(fd, state, sizeof(kma_pool_t), sizeof(header));
+  writeSnapshot(fd, &unlocked, sizeof(unlocked),
+		sizeof(header) + offsetof(kma_pool_t, pool_lock));
+  writeSnapshot(fd, root, size, sizeof(header) + sizeof(kma_pool_t));
+  
+  // pages above the bump pointer are zero, they stay holes in the file
+  for (i = 0; i < state->num_extent_slots; i++)
+    {
+      kma_extent_t* extent = &state->extents[i];
+      
+      if (extent->base != NULL)
+	{
+	  writeSnapshot(fd, &state->pages[i * EXTENTPAGES], slice,
+			pages_at + i * slice);
+	  writeSnapshot(fd, extent->base, (long) extent->bump * PAGESIZE,
+			pool_at + (long) i * EXTENTSIZE);
+	}
+    }
+  
+  if (ftruncate(fd, pool_at + (long) state->num_extent_slots * EXTENTSIZE) != 0)
+    {
+      error("Error writing the snapshot file", path);
+    }
+  
+  pthread_mutex_unlock(&state->pool_lock);
+  
+  close(fd);
+}
+
+void
+page_restore(char* path, void* root, int size)
+{
+  kma_snapshot_t header;
+  kma_pool_t* saved;
+  long slice, delta;
+  int page_size = gPageSize;
+  int page_colors = gPageColors;
+  int fd, i;
+  
+  if (state->shared)
+    {
+      error("can not restore a snapshot into a shared page pool", "");
+    }
+  
+  // the pool is replaced, so it must be empty
+  page_release();
+  
+  if (page_stats()->num_in_use != 0)
+    {
+      error("can not restore a snapshot while pages are in use", "");
+    }
+  
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    {
+      error("Error opening the snapshot file", path);
+    }
+  
+  readSnapshot(fd, &header, sizeof(header), 0);
+  if (memcmp(header.magic, SNAPSHOTMAGIC, sizeof(header.magic)) != 0)
+    {
+      error("not a page pool snapshot", path);
+    }
+  if (header.root_size != size)
+    {
+      error("the snapshot was taken by another allocator", path);
+    }
+  
+  // the saved state holds every extent, too much for a thread's stack
+  saved = malloc(sizeof(kma_pool_t));
+  if (saved == NULL)
+    {
+      error("Error allocating memory to restore the snapshot", path);
+    }
+  
+  readSnapshot(fd, saved, sizeof(kma_pool_t), sizeof(header));
+  
+  pthread_mutex_lock(&state->pool_lock);
+  
+  if (state->pool != NULL)
+    {
+      unreservePool();
+    }
+  
+  gPageSize = header.page_size;
+  gPageShift = __builtin_ctz(gPageSize);
+  gPageMask = ~((long) gPageSize - 1);
+  gPageColors = header.page_colors;
+  
+  // nothing is mapped from the file before both ranges are ours, so a
+  // restore that can not have them leaves the empty pool it found
+  state->pool = mapSnapshot(saved->pool, (long) saved->max_extents * EXTENTSIZE,
+			    PROT_NONE, -1, 0);
+  state->pages = mapSnapshot(saved->pages, (long) MAXPAGES * sizeof(kma_page_t),
+			     PROT_READ | PROT_WRITE, -1, 0);
+  if (state->pool == NULL || state->pages == NULL)
+    {
+      if (state->pool != NULL)
+	{
+	  munmap(state->pool, (long) saved->max_extents * EXTENTSIZE);
+	}
+      if (state->pages != NULL)
+	{
+	  munmap(state->pages, (long) MAXPAGES * sizeof(kma_page_t));
+	}
+      state->pool = NULL;
+      state->pages = NULL;
+      
+      gPageSize = page_size;
+      gPageShift = __builtin_ctz(gPageSize);
+      gPageMask = ~((long) gPageSize - 1);
+      gPageColors = page_colors;
+      
+      pthread_mutex_unlock(&state->pool_lock);
+      free(saved);
+      close(fd);
+      
+      error("the addresses the snapshot was saved from are taken", path);
+    }
+  
+  state->depot_next = mmap(NULL, (long) MAXPAGES * sizeof(unsigned int),
+			   PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (state->depot_next == MAP_FAILED)
+    {
+      error("Error using mmap to reserve the page depot", "");
+    }
+  
+  slice = (long) EXTENTPAGES * sizeof(kma_page_t);
+  for (i = 0; i < saved->num_extent_slots; i++)
+    {
+      if (saved->extents[i].base != NULL)
+	{
+	  mapSnapshot(&saved->pages[i * EXTENTPAGES], slice,
+		      PROT_READ | PROT_WRITE, fd, header.pages_at + i * slice);
+	  mapSnapshot(saved->extents[i].base, EXTENTSIZE,
+		      PROT_READ | PROT_WRITE, fd,
+		      header.pool_at + (long) i * EXTENTSIZE);
+	}
+    }
+  
+  readSnapshot(fd, root, size, sizeof(header) + sizeof(kma_pool_t));
+  close(fd);
+  
+  // take over the layout of the pool, but keep the policies and the
+  // lock of this process
+  memcpy(state->extents, saved->extents, sizeof(saved->extents));
+  state->num_extent_slots = saved->num_extent_slots;
+  state->max_extents = saved->max_extents;
+  state->num_empty = saved->num_empty;
+  state->num_idle = saved->num_idle;
+  state->num_idle_thps = saved->num_idle_thps;
+  state->num_untouched = saved->num_untouched;
+  state->kma_page_stats = saved->kma_page_stats;
+  state->kma_page_stats.backing = BACKING_SMALL;
+  state->kma_page_stats.num_hugetlb_extents = 0;
+  state->kma_page_stats.num_thp_extents = 0;
+  state->retired_requested = header.num_requested;
+  state->retired_freed = header.num_freed;
+  memcpy(state->num_tagged, header.num_tagged, sizeof(header.num_tagged));
+  memcpy(state->max_tagged, saved->max_tagged, sizeof(saved->max_tagged));
+  state->depot_head = 0;
+  state->depot_count = 0;
+  
+  // purging a page of the file mapping brings back its saved contents
+  state->lazy_purged = TRUE;
+  
+  // page groups kept in the root have moved with it
+  for (i = 0; i < state->num_extent_slots && size > 0; i++)
+    {
+      kma_page_t* page = &state->pages[i * EXTENTPAGES];
+      int j;
+      
+      for (j = 0; j < EXTENTPAGES && state->extents[i].base != NULL; j++)
+	{
+	  void* group = page[j].group;
+	  
+	  if (group >= header.root && group < header.root + size)
+	    {
+	      page[j].group = root + (group - header.root);
+	    }
+	}
+    }
+  
+  // the extent list links into the pool state, which may have moved
+  delta = (void*) state - (void*) header.state;
+  state->partial_extents = (saved->partial_extents == NULL) ? NULL
+    : (void*) saved->partial_extents + delta;
+  state->partial_tail = (saved->partial_tail == NULL) ? NULL
+    : (void*) saved->partial_tail + delta;
+  
+  // the empty extents all start expiring now, so their list is rebuilt
+  state->oldest_empty = NULL;
+  state->newest_empty = NULL;
+  
+  for (i = 0; i < state->num_extent_slots; i++)
+    {
+      kma_extent_t* extent = &state->extents[i];
+      
+      if (extent->prev != NULL)
+	{
+	  extent->prev = (void*) extent->prev + delta;
+	}
+      if (extent->next != NULL)
+	{
+	  extent->next = (void*) extent->next + delta;
+	}
+      
+      extent->backing = BACKING_SMALL;
+      extent->empty_since = now();
+      
+      if (extent->base != NULL && extent->num_in_use == 0)
+	{
+	  linkEmpty(extent);
+	}
+    }
+  
+  pthread_mutex_unlock(&state->pool_lock);
+  
+  free(saved);
+}
+
+void
+writeSnapshot(int fd, void* buf, long len, long offset)
+{
+  long n;
+  
+  for (; len > 0; buf += n, len -= n, offset += n)
+    {
+      n = pwrite(fd, buf, len, offset);
+      if (n <= 0)
+	{
+	  error("Error writing the snapshot file", "");
+	}
+    }
+}
+
+void
+readSnapshot(int fd, void* buf, long len, long offset)
+{
+  long n;
+  
+  for (; len > 0; buf += n, len -= n, offset += n)
+    {
+      n = pread(fd, buf, len, offset);
+      if (n <= 0)
+	{
+	  error("Error reading the snapshot file", "");
+	}
+    }
+}
+
+void*
+mapSnapshot(void* addr, long len, int prot, int fd, long offset)
+{
+  void* res;
+  
+  // copy-on-write from the file, or reserved where nothing was saved,
+  // which gives NULL if the range is taken; a saved range goes over
+  // its reservation
+  if (fd < 0)
+    {
+      res = mmap(addr, len, prot,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE,
+		 -1, 0);
+      
+      // a kernel without MAP_FIXED_NOREPLACE treats it as a hint
+      if (res != MAP_FAILED && res != addr)
+	{
+	  munmap(res, len);
+	}
+      
+      return (res == addr) ? res : NULL;
+    }
+  
+  res = mmap(addr, len, prot, MAP_PRIVATE | MAP_NORESERVE | MAP_FIXED,
+	     fd, offset);
+  if (res != addr)
+    {
+      error("Error using mmap to map the snapshot file", "");
+    }
+  
+  return res;
+}
+
+kma_cache_t*
+getCache()
+{
+  kma_cache_t* cache = &thread_cache;
+  
+  if (state->shared)
+    {
+      return &state->shared_cache;
+    }
+  
+  if (!cache->registered)
+    {
+      // the key's destructor hands the cache back when the thread exits
+      pthread_once(&cache_once, createCacheKey);
+      pthread_setspecific(cache_key, cache);
+      
+      pthread_mutex_lock(&state->pool_lock);
+      cache->registered = TRUE;
+      cache->next = caches;
+      caches = cache;
+      pthread_mutex_unlock(&state->pool_lock);
+    }
+  
+  return cache;
+}
+
+void
+createCacheKey()
+{
+  if (pthread_key_create(&cache_key, retireCache) != 0)
+    {
+      error("Error creating the page cache key", "");
+    }
+}
+
+void
+retireCache(void* arg)
+{
+  kma_cache_t* cache = (kma_cache_t*) arg;
+  kma_cache_t** i;
+  
+  pthread_mutex_lock(&state->pool_lock);
+  
+  for (i = &caches; *i != cache; i = &(*i)->next)
+    {
+      assert(*i != NULL);
+    }
+  *i = cache->next;
+  cache->registered = FALSE;
+  
+  // a thread that only used the private pool before it was shared has
+  // nothing left to hand back
+  if (state->shared)
+    {
+      pthread_mutex_unlock(&state->pool_lock);
+      return;
+    }
+  
+  drainCache(cache);
+  
+  state->retired_requested += cache->num_requested;
+  state->retired_freed += cache->num_freed;
+  cache->num_requested = 0;
+  cache->num_freed = 0;
+  
+  pthread_mutex_unlock(&state->pool_lock);
+}
+
+void*
+cachePop(kma_cache_t* cache)
+{
+  void* page;
+  int i;
+  
+  if (cache->count > 0)
+    {
+      return cache->pages[--cache->count];
+    }
+  
+  // a shared pool has no cache, only the depot
+  if (state->shared)
+    {
+      page = depotPop();
+      
+      if (page == NULL)
+	{
+	  pthread_mutex_lock(&state->pool_lock);
+	  page = allocPage();
+	  pthread_mutex_unlock(&state->pool_lock);
+	}
+      
+      return page;
+    }
+  
+  // refill half of the cache, from the depot if it has pages
+  for (i = 0; i < PAGECACHESIZE / 2; i++)
+    {
+      page = depotPop();
+      
+      if (page == NULL)
+	{
+	  break;
+	}
+      
+      cache->pages[cache->count++] = page;
+    }
+  
+  if (cache->count == 0)
+    {
+      pthread_mutex_lock(&state->pool_lock);
+      
+      for (i = 0; i < PAGECACHESIZE / 2; i++)
+	{
+	  cache->pages[cache->count++] = allocPage();
+	}
+      
+      pthread_mutex_unlock(&state->pool_lock);
+    }
+  
+  return cache->pages[--cache->count];
+}
+
+void
+cachePush(kma_cache_t* cache, void* page)
+{
+  int i, n = 0;
+  void* overflow[PAGECACHESIZE / 2];
+  
+  if (state->shared)
+    {
+      if (!depotPush(page))
+	{
+	  pthread_mutex_lock(&state->pool_lock);
+	  freeRun(page, 1);
+	  pthread_mutex_unlock(&state->pool_lock);
+	}
+      
+      return;
+    }
+  
+  if (cache->count == PAGECACHESIZE)
+    {
+      // move the older half to the depot, and what does not fit there
+      // back to its extent
+      for (i = 0; i < PAGECACHESIZE / 2; i++)
+	{
+	  if (!depotPush(cache->pages[i]))
+	    {
+	      overflow[n++] = cache->pages[i];
+	    }
+	}
+      
+      memmove(cache->pages, cache->pages + PAGECACHESIZE / 2,
+	      (PAGECACHESIZE - PAGECACHESIZE / 2) * sizeof(void*));
+      cache->count -= PAGECACHESIZE / 2;
+      
+      if (n > 0)
+	{
+	  pthread_mutex_lock(&state->pool_lock);
+	  
+	  for (i = 0; i < n; i++)
+	    {
+	      freeRun(overflow[i], 1);
+	    }
+	  
+	  pthread_mutex_unlock(&state->pool_lock);
+	}
+    }
+  
+  cache->pages[cache->count++] = page;
+}
+
+/* Hands the pages parked in the cache and in the depot back to their
+ * extents, so that the ones left empty can be released. The pool lock
+ * must be held.
+ */
+void
+drainCache(kma_cache_t* cache)
+{
+  void* page;
+  
+  while (cache->count > 0)
+    {
+      freeRun(cache->pages[--cache->count], 1);
+    }
+  
+  while ((page = depotPop()) != NULL)
+    {
+      freeRun(page, 1);
+    }
+}
+
+/* Parked pages keep their extents committed, so after a free they are
+ * now and then handed back when that could let the pool shrink to what
+ * it retains, and at once when nothing is in use any more.
+ */
+void
+trimCache(kma_cache_t* cache)
+{
+  int in_use;
+  
+  if (overRetained(&in_use) && (--cache->until_drain <= 0 || in_use == 0))
+    {
+      cache->until_drain = DEPOTPAGES;
+      
+      pthread_mutex_lock(&state->pool_lock);
+      drainCache(cache);
+      pthread_mutex_unlock(&state->pool_lock);
+    }
+}
+
+/* Tells whether the pool holds an extent beyond what it retains that
+ * the pages in use would not fill, i.e. one that could be released if
+ * the parked pages went back. Also counts the pages in use.
+ */
+bool
+overRetained(int* in_use)
+{
+  int num_extents = __atomic_load_n(&state->kma_page_stats.num_extents, __ATOMIC_RELAXED);
+  int i;
+  
+  if ((num_extents - 1) * EXTENTPAGES < state->retain_pages)
+    {
+      return FALSE;
+    }
+  
+  *in_use = 0;
+  for (i = 0; i < NUMPURPOSES; i++)
+    {
+      *in_use += __atomic_load_n(&state->num_tagged[i], __ATOMIC_RELAXED);
+    }
+  
+  return (num_extents - 1) * EXTENTPAGES >= *in_use;
+}
+
+void*
+depotPop()
+{
+  unsigned long head = __atomic_load_n(&state->depot_head, __ATOMIC_ACQUIRE);
+  unsigned long next;
+  unsigned int index;
+  
+  do
+    {
+      index = DEPOTINDEX(head);
+      
+      if (index == 0)
+	{
+	  return NULL;
+	}
+      
+      // the link may be stale if another thread wins the race, but
+      // then the tag has moved on and the exchange fails
+      next = DEPOTHEAD((head >> 32) + 1,
+		       __atomic_load_n(&state->depot_next[index - 1], __ATOMIC_RELAXED));
+    }
+  while (!__atomic_compare_exchange_n(&state->depot_head, &head, next, TRUE,
+				      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  
+  __atomic_sub_fetch(&state->depot_count, 1, __ATOMIC_RELAXED);
+  
+  return state->pool + (long) (index - 1) * PAGESIZE;
+}
+
+bool
+depotPush(void* page)
+{
+  unsigned int index = (page - state->pool) / PAGESIZE + 1;
+  unsigned long head, next;
+  
+  if (__atomic_add_fetch(&state->depot_count, 1, __ATOMIC_RELAXED) > DEPOTPAGES)
+    {
+      __atomic_sub_fetch(&state->depot_count, 1, __ATOMIC_RELAXED);
+      return FALSE;
+    }
+  
+  head = __atomic_load_n(&state->depot_head, __ATOMIC_RELAXED);
+  
+  do
+    {
+      __atomic_store_n(&state->depot_next[index - 1], DEPOTINDEX(head), __ATOMIC_RELAXED);
+      next = DEPOTHEAD((head >> 32) + 1, index);
+    }
+  while (!__atomic_compare_exchange_n(&state->depot_head, &head, next, TRUE,
+				      __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+  
+  return TRUE;
+}
+
+void
+countPages(int* counter, int n)
+{
+  // only the owning thread writes its counters, page_stats() reads
+  // them; the counters of a shared pool are written by everyone
+  if (state->shared)
+    {
+      __atomic_add_fetch(counter, n, __ATOMIC_RELEASE);
+    }
+  else
+    {
+      __atomic_store_n(counter, *counter + n, __ATOMIC_RELEASE);
+    }
+}
+
+void
+countTagged(kma_purpose_t purpose, int n)
+{
+  int tagged = __atomic_add_fetch(&state->num_tagged[purpose], n, __ATOMIC_RELAXED);
+  int peak = __atomic_load_n(&state->max_tagged[purpose], __ATOMIC_RELAXED);
+  
+  // only a count that has risen can raise the peak
+  while (tagged > peak
+	 && !__atomic_compare_exchange_n(&state->max_tagged[purpose], &peak, tagged,
+					 TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+      ;
+    }
+}
+
+void*
+allocPage()
+{
+  kma_extent_t* extent;
+  int index;
+  
+  extent = state->partial_extents;
+  
+  if (extent == NULL)
+    {
+      extent = addExtent();
+    }
+  
+  fillExtent(extent);
+  
+  if (extent->num_free > 0)
+    { // prefer the lowest resident page, it is likely still cached
+      index = lowestIdle(extent);
+      unmarkIdle(extent, index);
+    }
+  else if (extent->num_zeroed > 0)
+    { // zeroed pages are resident too
+      index = lowestBit(extent->zeroed);
+      CLEARBIT(extent->zeroed, index);
+      extent->num_zeroed--;
+      state->kma_page_stats.num_zeroed--;
+    }
+  else if (extent->num_purged == 0)
+    { // take a page that has never been used
+      assert(extent->bump < EXTENTPAGES);
+      
+      index = extent->bump++;
+      state->num_untouched--;
+    }
+  else
+    { // reuse the lowest purged page
+      index = lowestBit(extent->purged);
+      CLEARBIT(extent->purged, index);
+      extent->num_purged--;
+      state->kma_page_stats.num_purged--;
+    }
+  
+  return takePage(extent, index);
+}
+
+void*
+allocZeroedPage()
+{
+  kma_extent_t* extent;
+  void* ptr;
+  int index = -1;
+  
+  // look for a page that is known to be zero, queued ones first
+  for (extent = state->partial_extents; extent != NULL; extent = extent->next)
+    {
+      if (extent->num_zeroed > 0)
+	{
+	  index = lowestBit(extent->zeroed);
+	  CLEARBIT(extent->zeroed, index);
+	  extent->num_zeroed--;
+	  state->kma_page_stats.num_zeroed--;
+	  break;
+	}
+      
+      if (extent->bump < EXTENTPAGES)
+	{
+	  index = extent->bump++;
+	  state->num_untouched--;
+	  break;
+	}
+      
+      if (extent->num_purged > 0 && !state->lazy_purged)
+	{
+	  index = lowestBit(extent->purged);
+	  CLEARBIT(extent->purged, index);
+	  extent->num_purged--;
+	  state->kma_page_stats.num_purged--;
+	  break;
+	}
+    }
+  
+  if (extent != NULL)
+    {
+      fillExtent(extent);
+      return takePage(extent, index);
+    }
+  
+  // there is none, clear a recycled page (a new extent has only fresh
+  // pages, which are zero)
+  if (state->partial_extents == NULL)
+    {
+      addExtent();
+      return allocZeroedPage();
+    }
+  
+  ptr = allocPage();
+  zeroPage(ptr);
+  
+  return ptr;
+}
+
+void*
+takePage(kma_extent_t* extent, int index)
+{
+  CLEARBIT(extent->free, index);
+  extent->num_in_use++;
+  
+  // a full extent has nothing left to hand out
+  if (extent->num_in_use == EXTENTPAGES)
+    {
+      unlinkExtent(extent);
+    }
+  
+  return extent->base + index * PAGESIZE;
+}
+
+void
+queueZeroed(void* ptr)
+{
+  kma_extent_t* extent = findExtent(ptr);
+  int index = (ptr - extent->base) / PAGESIZE;
+  
+  if (extent->num_in_use == EXTENTPAGES)
+    {
+      linkExtent(extent);
+    }
+  
+  extent->num_in_use--;
+  
+  assert(!TESTBIT(extent->free, index));
+  SETBIT(extent->free, index);
+  SETBIT(extent->zeroed, index);
+  extent->num_zeroed++;
+  state->kma_page_stats.num_zeroed++;
+  
+  if (extent->num_in_use == 0)
+    {
+      emptyExtent(extent);
+    }
+}
+
+void
+zeroPage(void* ptr)
+{
+#ifdef __SSE2__
+  __m128i zero = _mm_setzero_si128();
+  __m128i* line = (__m128i*) ptr;
+  __m128i* end = (__m128i*) (ptr + PAGESIZE);
+  
+  // non-temporal stores do not pull the page into the cache
+  for (; line < end; line += 4)
+    {
+      _mm_stream_si128(line, zero);
+      _mm_stream_si128(line + 1, zero);
+      _mm_stream_si128(line + 2, zero);
+      _mm_stream_si128(line + 3, zero);
+    }
+  
+  _mm_sfence();
+#else
+  memset(ptr, 0, PAGESIZE);
+#endif
+}
+
+int
+lowestBit(unsigned long* map)
+{
+  int i;
+  
+  for (i = 0; map[i] == 0; i++)
+    {
+      assert(i < BITMAPWORDS - 1);
+    }
+  
+  return i * BITSPERWORD + __builtin_ctzl(map[i]);
+}
+
+void*
+allocRun(int n)
+{
+  kma_extent_t* extent;
+  int index = -1;
+  int i;
+  
+  for (extent = state->partial_extents; extent != NULL; extent = extent->next)
+    {
+      if (EXTENTPAGES - extent->num_in_use >= n)
+	{
+	  index = findRun(extent, n);
+	  
+	  if (index >= 0)
+	    {
+	      break;
+	    }
+	}
+    }
+  
+  if (extent == NULL)
+    {
+      extent = addExtent();
+      index = findRun(extent, n);
+    }
+  
+  assert(index >= 0);
+  
+  fillExtent(extent);
+  
+  for (i = index; i < index + n; i++)
+    {
+      if (i >= extent->bump)
+	{
+	  ; // never used, nothing links to it
+	}
+      else if (TESTBIT(extent->purged, i))
+	{
+	  CLEARBIT(extent->purged, i);
+	  extent->num_purged--;
+	  state->kma_page_stats.num_purged--;
+	}
+      else if (TESTBIT(extent->zeroed, i))
+	{
+	  CLEARBIT(extent->zeroed, i);
+	  extent->num_zeroed--;
+	  state->kma_page_stats.num_zeroed--;
+	}
+      else
+	{
+	  unmarkIdle(extent, i);
+	}
+      
+      CLEARBIT(extent->free, i);
+    }
+  
+  // never used pages the run skips are not resident either, so they
+  // are kept as purged pages below the new bump pointer
+  if (index + n > extent->bump)
+    {
+      for (i = extent->bump; i < index; i++)
+	{
+	  SETBIT(extent->purged, i);
+	}
+      
+      // a run may also start below the bump pointer and reach past it
+      if (index > extent->bump)
+	{
+	  extent->num_purged += index - extent->bump;
+	  state->kma_page_stats.num_purged += index - extent->bump;
+	}
+      state->num_untouched -= index + n - extent->bump;
+      extent->bump = index + n;
+    }
+  
+  extent->num_in_use += n;
+  
+  if (extent->num_in_use == EXTENTPAGES)
+    {
+      unlinkExtent(extent);
+    }
+  
+  return extent->base + index * PAGESIZE;
+}
+
+void
+freeRun(void* ptr, int n)
+{
+  kma_extent_t* extent;
+  int index, i;
+  
+  assert(ptr != NULL);
+  
+  extent = findExtent(ptr);
+  index = (ptr - extent->base) / PAGESIZE;
+  
+  assert(extent->num_in_use >= n);
+  
+  if (extent->num_in_use == EXTENTPAGES)
+    {
+      linkExtent(extent);
+    }
+  
+  extent->num_in_use -= n;
+  
+  for (i = index; i < index + n; i++)
+    {
+      assert(!TESTBIT(extent->free, i));
+      SETBIT(extent->free, i);
+    }
+  
+  if (state->purge_policy == PURGE_IMMEDIATE && extent->backing == BACKING_SMALL)
+    {
+      purgeRun(ptr, n);
+      
+      for (i = index; i < index + n; i++)
+	{
+	  SETBIT(extent->purged, i);
+	}
+      
+      extent->num_purged += n;
+      state->kma_page_stats.num_purged += n;
+    }
+  else
+    {
+      for (i = index; i < index + n; i++)
+	{
+	  markIdle(extent, i);
+	}
+      
+      // transparent huge pages are purged once they are wholly free
+      if (state->purge_policy == PURGE_IMMEDIATE && extent->backing == BACKING_THP)
+	{
+	  purgeExtent(extent, n);
+	}
+    }
+  
+  if (extent->num_in_use == 0)
+    {
+      emptyExtent(extent);
+    }
+  else if (state->num_empty > 0 && state->retain_idle_ms > 0)
+    {
+      sweepExtents(FALSE);
+    }
+  
+  // purge down to half the threshold so that the madvise calls are
+  // batched instead of issued once per freed page; idle pages of
+  // transparent huge pages can only be purged once one is wholly idle,
+  // so until then there is nothing to scan for
+  if (state->purge_policy == PURGE_IDLE && state->num_idle > state->purge_idle_pages
+      && (extent->backing != BACKING_THP || state->num_idle_thps > 0))
+    {
+      purgeIdle(state->num_idle - state->purge_idle_pages / 2);
+    }
+}
+
+void
+reservePool()
+{
+  assert(state->pool == NULL);
+  
+  state->pool = reserveAligned((long) state->max_extents * EXTENTSIZE);
+  
+  // the descriptor table only becomes resident where it is touched
+  state->pages = mmap(NULL, (long) MAXPAGES * sizeof(kma_page_t),
+		      PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (state->pages == MAP_FAILED)
+    {
+      error("Error using mmap to reserve the page descriptors", "");
+    }
+  
+  state->depot_next = mmap(NULL, (long) MAXPAGES * sizeof(unsigned int),
+			   PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (state->depot_next == MAP_FAILED)
+    {
+      error("Error using mmap to reserve the page depot", "");
+    }
+}
+
+void*
+reserveAligned(long size)
+{
+  void* res;
+  void* end;
+  void* base;
+  
+  // reserve one extent more than needed so the result can be aligned
+  res = mmap(NULL, size + EXTENTSIZE, PROT_NONE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (res == MAP_FAILED)
+    {
+      error("Error using mmap to reserve the page pool", "");
+    }
+  
+  base = (void*)(((long) res + EXTENTSIZE - 1) & ~((long) EXTENTSIZE - 1));
+  end = res + size + EXTENTSIZE;
+  
+  if (base != res)
+    {
+      munmap(res, base - res);
+    }
+  if (end != base + size)
+    {
+      munmap(base + size, end - (base + size));
+    }
+  
+  return base;
+}
+
+void
+unreservePool()
+{
+  munmap(state->pool, (long) state->max_extents * EXTENTSIZE);
+  munmap(state->pages, (long) MAXPAGES * sizeof(kma_page_t));
+  munmap(state->depot_next, (long) MAXPAGES * sizeof(unsigned int));
+  
+  state->pool = NULL;
+  state->pages = NULL;
+  state->depot_next = NULL;
+}
+
+kma_extent_t*
+addExtent()
+{
+  kma_extent_t* extent;
+  int i;
+  
+  if (state->pool == NULL)
+    {
+      reservePool();
+    }
+  
+  // reuse the lowest extent that has been released
+  for (i = 0; i < state->num_extent_slots; i++)
+    {
+      if (state->extents[i].base == NULL)
+	{
+	  break;
+	}
+    }
+  
+  if (i == state->max_extents)
+    {
+      error("error: all extents already allocated", "");
+    }
+  
+  if (i == state->num_extent_slots)
+    {
+      state->num_extent_slots++;
+    }
+  
+  extent = &state->extents[i];
+  extent->base = state->pool + (long) i * EXTENTSIZE;
+  
+  // committing into an empty pool means it has been torn down before
+  if (state->kma_page_stats.num_extents == 0 && state->kma_page_stats.num_releases > 0)
+    {
+      state->kma_page_stats.num_rebuilds++;
+    }
+  
+  commitExtent(extent);
+  initPages(extent);
+  linkExtent(extent);
+  
+  // it is empty until the caller takes its pages
+  extent->empty_since = now();
+  state->num_empty++;
+  linkEmpty(extent);
+  
+  state->kma_page_stats.num_extents++;
+  state->kma_page_stats.num_commits++;
+  state->kma_page_stats.committed_bytes += EXTENTSIZE;
+  
+  return extent;
+}
+
+void
+removeExtent(kma_extent_t* extent)
+{
+  assert(extent->num_in_use == 0);
+  
+  unlinkExtent(extent);
+  unlinkEmpty(extent);
+  state->num_empty--;
+  
+  decommitExtent(extent);
+  
+  state->num_idle -= extent->num_free;
+  state->num_idle_thps -= extent->num_idle_thps;
+  state->num_untouched -= EXTENTPAGES - extent->bump;
+  state->kma_page_stats.num_purged -= extent->num_purged;
+  state->kma_page_stats.num_zeroed -= extent->num_zeroed;
+  
+  extent->base = NULL;
+  
+  while (state->num_extent_slots > 0 && state->extents[state->num_extent_slots - 1].base == NULL)
+    {
+      state->num_extent_slots--;
+    }
+  
+  state->kma_page_stats.num_extents--;
+  state->kma_page_stats.num_releases++;
+  state->kma_page_stats.committed_bytes -= EXTENTSIZE;
+}
+
+void
+commitExtent(kma_extent_t* extent)
+{
+  extent->backing = BACKING_SMALL;
+  
+  // a shared segment is mapped whole, its memory is allocated as the
+  // pages are touched
+  if (state->shared)
+    {
+      return;
+    }
+  
+#ifdef MAP_HUGETLB
+  // extents are aligned to their size, which is a multiple of the
+  // huge page size, so they can be remapped onto huge pages in place
+  if (state->backing == BACKING_HUGETLB
+      && mmap(extent->base, EXTENTSIZE, PROT_READ | PROT_WRITE,
+	      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0)
+      == extent->base)
+    {
+      extent->backing = BACKING_HUGETLB;
+    }
+#endif
+  
+  if (extent->backing == BACKING_SMALL)
+    {
+      // a failed MAP_FIXED may already have unmapped the reservation,
+      // so map the extent again rather than just changing protection
+      if (mmap(extent->base, EXTENTSIZE, PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0)
+	  != extent->base)
+	{
+	  error("Error using mmap to commit an extent", "");
+	}
+      
+#ifdef MADV_HUGEPAGE
+      // fall back to transparent huge pages if none are reserved
+      if (state->backing != BACKING_SMALL
+	  && madvise(extent->base, EXTENTSIZE, MADV_HUGEPAGE) == 0)
+	{
+	  extent->backing = BACKING_THP;
+	}
+#endif
+    }
+  
+  state->kma_page_stats.backing = extent->backing;
+  
+  if (extent->backing == BACKING_HUGETLB)
+    {
+      state->kma_page_stats.num_hugetlb_extents++;
+    }
+  else if (extent->backing == BACKING_THP)
+    {
+      state->kma_page_stats.num_thp_extents++;
+    }
+}
+
+void
+decommitExtent(kma_extent_t* extent)
+{
+  if (state->shared)
+    {
+      if (madvise(extent->base, EXTENTSIZE, MADV_REMOVE) != 0)
+	{
+	  error("Error using madvise to release a shared extent", "");
+	}
+      
+      return;
+    }
+  
+  // mapping the reservation back in place drops the memory, whatever
+  // the extent was backed with
+  if (mmap(extent->base, EXTENTSIZE, PROT_NONE,
+	   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0)
+      != extent->base)
+    {
+      error("Error using mmap to release an extent", "");
+    }
+  
+  if (extent->backing == BACKING_HUGETLB)
+    {
+      state->kma_page_stats.num_hugetlb_extents--;
+    }
+  else if (extent->backing == BACKING_THP)
+    {
+      state->kma_page_stats.num_thp_extents--;
+    }
+}
+
+kma_extent_t*
+findExtent(void* ptr)
+{
+  long i = (ptr - state->pool) / EXTENTSIZE;
+  
+  assert(i >= 0 && i < state->num_extent_slots);
+  
+  return &state->extents[i];
+}
+
+void
+linkExtent(kma_extent_t* extent)
+{
+  extent->prev = NULL;
+  extent->next = state->partial_extents;
+  
+  if (state->partial_extents != NULL)
+    {
+      state->partial_extents->prev = extent;
+    }
+  else
+    {
+      state->partial_tail = extent;
+    }
+  
+  state->partial_extents = extent;
+}
+
+void
+linkExtentTail(kma_extent_t* extent)
+{
+  extent->prev = state->partial_tail;
+  extent->next = NULL;
+  
+  if (state->partial_tail != NULL)
+    {
+      state->partial_tail->next = extent;
+    }
+  else
+    {
+      state->partial_extents = extent;
+    }
+  
+  state->partial_tail = extent;
+}
+
+void
+unlinkExtent(kma_extent_t* extent)
+{
+  if (extent->prev != NULL)
+    {
+      extent->prev->next = extent->next;
+    }
+  else
+    {
+      state->partial_extents = extent->next;
+    }
+  
+  if (extent->next != NULL)
+    {
+      extent->next->prev = extent->prev;
+    }
+  else
+    {
+      state->partial_tail = extent->prev;
+    }
+  
+  extent->prev = NULL;
+  extent->next = NULL;
+}
+
+void
+emptyExtent(kma_extent_t* extent)
+{
+  assert(extent->num_in_use == 0);
+  
+  extent->empty_since = now();
+  state->num_empty++;
+  linkEmpty(extent);
+  
+  unlinkExtent(extent);
+  linkExtentTail(extent);
+  
+  sweepExtents(FALSE);
+}
+
+void
+fillExtent(kma_extent_t* extent)
+{
+  if (extent->num_in_use == 0)
+    {
+      state->num_empty--;
+      unlinkEmpty(extent);
+    }
+}
+
+void
+linkEmpty(kma_extent_t* extent)
+{
+  extent->older = state->newest_empty;
+  extent->newer = NULL;
+  
+  if (state->newest_empty != NULL)
+    {
+      state->newest_empty->newer = extent;
+    }
+  else
+    {
+      state->oldest_empty = extent;
+    }
+  
+  state->newest_empty = extent;
+}
+
+void
+unlinkEmpty(kma_extent_t* extent)
+{
+  if (extent->older != NULL)
+    {
+      extent->older->newer = extent->newer;
+    }
+  else
+    {
+      state->oldest_empty = extent->newer;
+    }
+  
+  if (extent->newer != NULL)
+    {
+      extent->newer->older = extent->older;
+    }
+  else
+    {
+      state->newest_empty = extent->older;
+    }
+  
+  extent->older = NULL;
+  extent->newer = NULL;
+}
+
+void
+sweepExtents(bool all)
+{
+  kma_extent_t* extent;
+  long time = (all || state->oldest_empty == NULL) ? 0 : now();
+  
+  // the oldest empty extent expires first, so the sweep stops at the
+  // first one that is retained
+  while ((extent = state->oldest_empty) != NULL)
+    {
+      if (!all
+	  && ((state->kma_page_stats.num_extents - 1) * EXTENTPAGES < state->retain_pages
+	      || time - extent->empty_since < state->retain_idle_ms))
+	{
+	  break;
+	}
+      
+      removeExtent(extent);
+    }
+}
+
+long
+now()
+{
+  struct timespec ts;
+  
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void
+initPages(kma_extent_t* extent)
+{
+  // nothing is written into the pages, they are handed out from the
+  // bump pointer as they are first needed
+  extent->num_in_use = 0;
+  extent->num_free = 0;
+  extent->num_purged = 0;
+  extent->bump = 0;
+  memset(extent->free, 0xff, sizeof(extent->free));
+  memset(extent->idle, 0, sizeof(extent->idle));
+  extent->idle_summary = 0;
+  memset(extent->thp_idle, 0, sizeof(extent->thp_idle));
+  extent->num_idle_thps = 0;
+  memset(extent->purged, 0, sizeof(extent->purged));
+  memset(extent->zeroed, 0, sizeof(extent->zeroed));
+  extent->num_zeroed = 0;
+  
+  state->num_untouched += EXTENTPAGES;
+}
+
+int
+findRun(kma_extent_t* extent, int n)
+{
+  int align = 1;
+  int start, used;
+  
+  // runs are aligned to the largest power of two not above their length
+  while (align * 2 <= n)
+    {
+      align <<= 1;
+    }
+  
+  for (start = 0; start + n <= EXTENTPAGES; start += align)
+    {
+      used = firstUsed(extent, start, n);
+      
+      if (used < 0)
+	{
+	  return start;
+	}
+      
+      // no run that covers the used page can work, skip past it
+      start = (used / align) * align;
+    }
+  
+  return -1;
+}
+
+int
+firstUsed(kma_extent_t* extent, int start, int n)
+{
+  int i = start;
+  int end = start + n;
+  
+  while (i < end)
+    {
+      int bit = i % BITSPERWORD;
+      int len = BITSPERWORD - bit;
+      unsigned long mask, used;
+      
+      if (len > end - i)
+	{
+	  len = end - i;
+	}
+      
+      mask = (len == BITSPERWORD) ? ~0UL : ((1UL << len) - 1) << bit;
+      used = ~extent->free[i / BITSPERWORD] & mask;
+      
+      if (used != 0)
+	{
+	  return (i - bit) + __builtin_ctzl(used);
+	}
+      
+      i += len;
+    }
+  
+  return -1;
+}
+
+void
+markIdle(kma_extent_t* extent, int index)
+{
+  SETBIT(extent->idle, index);
+  extent->idle_summary |= 1UL << (index / BITSPERWORD);
+  if (++extent->thp_idle[index / THPPAGES] == THPPAGES)
+    {
+      extent->num_idle_thps++;
+      state->num_idle_thps++;
+    }
+  extent->num_free++;
+  state->num_idle++;
+}
+
+void
+unmarkIdle(kma_extent_t* extent, int index)
+{
+  CLEARBIT(extent->idle, index);
+  if (extent->idle[index / BITSPERWORD] == 0)
+    {
+      extent->idle_summary &= ~(1UL << (index / BITSPERWORD));
+    }
+  if (extent->thp_idle[index / THPPAGES]-- == THPPAGES)
+    {
+      extent->num_idle_thps--;
+      state->num_idle_thps--;
+    }
+  extent->num_free--;
+  state->num_idle--;
+}
+
+int
+lowestIdle(kma_extent_t* extent)
+{
+  int word;
+  
+  assert(extent->idle_summary != 0);
+  
+  word = __builtin_ctzl(extent->idle_summary);
+  
+  return word * BITSPERWORD + __builtin_ctzl(extent->idle[word]);
+}
+
+int
+highestIdle(kma_extent_t* extent)
+{
+  int word;
+  
+  assert(extent->idle_summary != 0);
+  
+  word = BITSPERWORD - 1 - __builtin_clzl(extent->idle_summary);
+  
+  return word * BITSPERWORD + BITSPERWORD - 1 - __builtin_clzl(extent->idle[word]);
+}
+
+int
+purgeIdle(int count)
+{
+  kma_extent_t* extent;
+  int purged = 0;
+  
+  for (extent = state->partial_extents;
+       extent != NULL && purged < count;
+       extent = extent->next)
+    {
+      purged += purgeExtent(extent, count - purged);
+    }
+  
+  return purged;
+}
+
+int
+purgeExtent(kma_extent_t* extent, int count)
+{
+  int index[EXTENTPAGES];
+  int n = 0;
+  int i, run;
+  
+  // huge pages can not be purged one logical page at a time, and
+  // purging part of a transparent one splits it
+  if (extent->backing == BACKING_HUGETLB)
+    {
+      return 0;
+    }
+  else if (extent->backing == BACKING_THP)
+    {
+      return purgeHugePages(extent, count);
+    }
+  
+  // purge the highest idle pages, the lowest ones are handed out first
+  while (n < count && extent->idle_summary != 0)
+    {
+      index[n] = highestIdle(extent);
+      unmarkIdle(extent, index[n++]);
+    }
+  
+  // the pages are in descending order, adjacent ones are purged as one
+  // run
+  for (i = 0; i < n; i += run)
+    {
+      for (run = 1; i + run < n && index[i + run] == index[i] - run; run++)
+	{
+	  ;
+	}
+      
+      purgeRun(extent->base + index[i + run - 1] * PAGESIZE, run);
+    }
+  
+  for (i = 0; i < n; i++)
+    {
+      SETBIT(extent->purged, index[i]);
+    }
+  
+  extent->num_purged += n;
+  state->kma_page_stats.num_purged += n;
+  
+  return n;
+}
+
+int
+purgeHugePages(kma_extent_t* extent, int count)
+{
+  int n = 0;
+  int first, i;
+  
+  // the highest wholly idle huge pages, at least count logical pages;
+  // the counts tell which they are without reading the idle bitmap
+  for (first = EXTENTPAGES - THPPAGES;
+       first >= 0 && n < count && extent->num_idle_thps > 0;
+       first -= THPPAGES)
+    {
+      if (extent->thp_idle[first / THPPAGES] < THPPAGES)
+	{
+	  continue;
+	}
+      
+      purgeRun(extent->base + first * PAGESIZE, THPPAGES);
+      
+      for (i = first; i < first + THPPAGES; i++)
+	{
+	  unmarkIdle(extent, i);
+	  SETBIT(extent->purged, i);
+	}
+      n += THPPAGES;
+    }
+  
+  extent->num_purged += n;
+  state->kma_page_stats.num_purged += n;
+  
+  return n;
+}
+
+void
+purgeRun(void* ptr, int n)
+{
+  // pages mapped from a snapshot can not be freed lazily
+  if (madvise(ptr, (long) n * PAGESIZE, state->purge_advice) != 0
+      && (state->purge_advice == MADV_DONTNEED
+	  || madvise(ptr, (long) n * PAGESIZE, MADV_DONTNEED) != 0))
+    {
+      error("Error using madvise to purge free pages", "");
+    }
+  
+  if (state->purge_advice != MADV_DONTNEED
+      && state->purge_advice != MADV_REMOVE)
+    {
+      state->lazy_purged = TRUE;
+    }
 }
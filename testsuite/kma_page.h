@@ -62,9 +62,60 @@
 #define EXTERN extern
 #endif
 
-#define PAGESIZE 8192
+/* The page size is a power of two between MINPAGESIZE and MAXPAGESIZE
+ * chosen at run time with page_geometry(); PAGESIZE and BASEADDR read
+ * it, and the page mask, from globals set there.
+ */
+#define PAGESIZE gPageSize
+
+#define DEFAULTPAGESIZE 8192
+
+#define MINPAGESIZE 4096
+
+#define MAXPAGESIZE 65536
+
+/* The pool grows and shrinks in extents of EXTENTPAGES contiguous
+ * pages. Address space for the pool is reserved once with mmap, and
+ * extents are committed into it on demand, so the pool size only
+ * bounds the reservation, not the memory that is committed up front.
+ * MAXEXTENTS bounds the pool size.
+ */
+#define EXTENTPAGES 512
+
+#define EXTENTSIZE (EXTENTPAGES * PAGESIZE)
+
+#define MAXEXTENTS 4096
+
+#define MAXPAGES (EXTENTPAGES * MAXEXTENTS)
+
+#define DEFAULTPOOLSIZE ((long) MAXEXTENTS * EXTENTPAGES * DEFAULTPAGESIZE)
 
-#define MAXPAGES 4096
+/* runs of contiguous pages never span two extents */
+#define MAXRUNPAGES EXTENTPAGES
+
+/* Single pages are cached per thread, and up to DEPOTPAGES free pages
+ * are shared between the thread caches without taking the pool lock.
+ * Cached pages still count as used by their extent, so they are not
+ * purged and keep the extent from being released. Every DEPOTPAGES
+ * frees, or once no page is in use, a thread drains its cache and the
+ * depot back into the extents when more than the retained pages are
+ * committed.
+ */
+#define PAGECACHESIZE 16
+
+#define DEPOTPAGES 256
+
+/* By default one extent stays committed when the pool drains, and
+ * empty extents beyond it are released right away.
+ */
+#define RETAINPAGES EXTENTPAGES
+
+#define RETAINIDLEMS 0
+
+/* A shared pool reserves room for the root of one heap next to its
+ * state, where every process using the pool finds it.
+ */
+#define ROOTSIZE 4096
 
 /***********************************************************************
  *  Title: Base Address Macro
@@ -74,35 +125,135 @@
  *    Input: pointer
  *    Output: the base address of the page
  ***********************************************************************/
-#define BASEADDR(x) ((void*)(((long) (x)) & ~(PAGESIZE-1)))
+#define BASEADDR(x) ((void*)(((long) (x)) & gPageMask))
 
-typedef struct
+/* Metadata kept at the start of every page maps to the same few cache
+ * sets. Pages are therefore colored: the color rotates with the page
+ * number over gPageColors colors, and the algorithms place their
+ * per-page headers and first objects PAGECOLOR() bytes into the page.
+ * The number of colors is a power of two set with page_coloring().
+ */
+#define CACHELINESIZE 64
+
+#define DEFAULTPAGECOLORS 8
+
+#define MAXPAGECOLORS 32
+
+/***********************************************************************
+ *  Title: Page Color Macro
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the color offset of the page holding a pointer
+ *    Input: pointer
+ *    Output: the offset from the base address, a multiple of
+ *            CACHELINESIZE below MAXPAGECOLOR
+ ***********************************************************************/
+#define PAGECOLOR(x) (((((long) (x)) >> gPageShift) & (gPageColors - 1)) * CACHELINESIZE)
+
+/* the largest color offset of any page */
+#define MAXPAGECOLOR ((gPageColors - 1) * CACHELINESIZE)
+
+/* what an allocator uses a page for; page_stats() counts the pages in
+ * use for each purpose */
+typedef enum
+{
+  PAGE_DATA,
+  PAGE_METADATA,
+  PAGE_CACHE,
+  PAGE_LARGE,
+  NUMPURPOSES
+} kma_purpose_t;
+
+/* A page group links the pages added to it through their descriptors,
+ * so that free_page_group() releases all of them in O(pages), without
+ * the allocator walking its own structures. A page leaves its group
+ * when it is freed.
+ */
+typedef struct kma_page_group
+{
+  struct kma_page* first;
+  int num_pages;
+} kma_page_group_t;
+
+/* Page descriptors live in a flat table indexed by page number, so
+ * they are never allocated per page and find_page() is O(1). The
+ * trailing fields are not used by the page layer; they are cleared by
+ * get_page() and free for the allocator that owns the page.
+ */
+typedef struct kma_page
 {
   int id;
   void* ptr;
   int size;
+  kma_purpose_t purpose;
+  kma_page_group_t* group;
+  struct kma_page* group_prev;
+  struct kma_page* group_next;
+  void* owner;
+  int size_class;
+  int free_count;
 } kma_page_t;
 
+/* what the extents of the pool are backed with */
+typedef enum
+{
+  BACKING_SMALL,
+  BACKING_HUGETLB,
+  BACKING_THP
+} kma_backing_t;
+
 typedef struct
 {
   int num_requested;
   int num_freed;
   int num_in_use;
   int page_size;
+  int num_extents;
+  long committed_bytes;
+  int num_purged;
+  long resident_bytes;
+  kma_backing_t backing;
+  int num_hugetlb_extents;
+  int num_thp_extents;
+  int num_commits;
+  int num_releases;
+  int num_rebuilds;
+  int num_zeroed;
+  int num_tagged[NUMPURPOSES];
+  int max_tagged[NUMPURPOSES];
 } kma_page_stat_t;
 
+/* when free pages are handed back to the operating system */
+typedef enum
+{
+  PURGE_IMMEDIATE,
+  PURGE_IDLE,
+  PURGE_EXPLICIT
+} kma_purge_policy_t;
+
+/* number of idle free pages the default PURGE_IDLE policy keeps */
+#define PURGEIDLEPAGES EXTENTPAGES
+
 /************Global Variables*********************************************/
 
+/* the page size, its log2 and the mask that rounds an address down to
+ * its page */
+EXTERN int gPageSize;
+EXTERN int gPageShift;
+EXTERN long gPageMask;
+
+/* the number of page colors */
+EXTERN int gPageColors;
+
 /************Function Prototypes******************************************/
 
 /***********************************************************************
  *  Title: Allocates a memory page
  * ---------------------------------------------------------------------
  *    Purpose: Allocates a memory page
- *    Input: none
+ *    Input: what the page is used for
  *    Output: the allocated memory page
  ***********************************************************************/
-EXTERN kma_page_t* get_page();
+EXTERN kma_page_t* get_page(kma_purpose_t);
 
 /***********************************************************************
  *  Title: Releases a memory page 
@@ -113,15 +264,290 @@ EXTERN kma_page_t* get_page();
  ***********************************************************************/
 EXTERN void free_page(kma_page_t*);
 
+/***********************************************************************
+ *  Title: Allocates contiguous memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates a run of n adjacent memory pages. The run is
+ *             aligned to the largest power of two pages not above n,
+ *             so a run of 2^k pages is naturally aligned.
+ *    Input: the number of pages, at most MAXRUNPAGES, and what they
+ *           are used for
+ *    Output: the page structure of the first page, whose size
+ *            covers the whole run, or NULL if n is too large
+ ***********************************************************************/
+EXTERN kma_page_t* get_pages(int n, kma_purpose_t purpose);
+
+/***********************************************************************
+ *  Title: Allocates a zeroed memory page
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates a memory page that is filled with zeros. Pages
+ *             known to be zero, those queued by page_prezero(), never
+ *             used ones and ones purged without MADV_FREE, are handed
+ *             out first, so the page is only cleared here when there
+ *             is none of them
+ *    Input: what the page is used for
+ *    Output: the allocated memory page
+ ***********************************************************************/
+EXTERN kma_page_t* get_zeroed_page(kma_purpose_t);
+
+/***********************************************************************
+ *  Title: Releases contiguous memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases a run of memory pages (or a single page)
+ *    Input: the page structure returned by get_pages()
+ *    Output: none
+ ***********************************************************************/
+EXTERN void free_pages(kma_page_t*);
+
+/***********************************************************************
+ *  Title: Allocates a batch of memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates n single pages, not necessarily adjacent, with
+ *             one update of the statistics and at most one round trip
+ *             to the pool lock
+ *    Input: the number of pages, an array for their structures and
+ *           what the pages are used for
+ *    Output: the number of pages allocated, which is n
+ ***********************************************************************/
+EXTERN int get_pages_batch(int n, kma_page_t* out[], kma_purpose_t purpose);
+
+/***********************************************************************
+ *  Title: Releases a batch of memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases n pages or runs of pages with one update of the
+ *             statistics and at most one round trip to the pool lock
+ *    Input: an array of page structures returned by get_page(),
+ *           get_pages() or get_pages_batch(), and its length
+ *    Output: none
+ ***********************************************************************/
+EXTERN void free_pages_batch(kma_page_t* batch[], int n);
+
+/***********************************************************************
+ *  Title: Adds a page to a group
+ * ---------------------------------------------------------------------
+ *    Purpose: Links a page or run of pages into a page group, which
+ *             it leaves again when it is freed. A group is not locked;
+ *             it is used by one thread at a time.
+ *    Input: the group, the page structure of an allocated page
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_group_add(kma_page_group_t* group, kma_page_t* page);
+
+/***********************************************************************
+ *  Title: Releases a page group
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases every page in the group, leaving it empty, in
+ *             batches of free_pages_batch()
+ *    Input: the group
+ *    Output: the number of pages released
+ ***********************************************************************/
+EXTERN int free_page_group(kma_page_group_t* group);
+
+/***********************************************************************
+ *  Title: Find a memory page
+ * ---------------------------------------------------------------------
+ *    Purpose: Look up the page structure of an allocated page
+ *    Input: any pointer into the page (into the first page of a run)
+ *    Output: the memory page structure
+ ***********************************************************************/
+EXTERN kma_page_t* find_page(void*);
+
 /***********************************************************************
  *  Title: Memory page statistics
  * ---------------------------------------------------------------------
- *    Purpose: Get the memory page statistics
+ *    Purpose: Get the memory page statistics, including the pages
+ *             in use per purpose and their high-water marks since the
+ *             pool was created
  *    Input: none 
  *    Output: the memory page statistics in a static buffer
  ***********************************************************************/
 EXTERN kma_page_stat_t* page_stats();
 
+/***********************************************************************
+ *  Title: Page purge policy
+ * ---------------------------------------------------------------------
+ *    Purpose: Select when free pages are returned to the operating
+ *             system. PURGE_IMMEDIATE purges every page as it is
+ *             freed, PURGE_IDLE purges once more than idle_pages free
+ *             pages are still resident, and PURGE_EXPLICIT only
+ *             purges from page_purge(). With lazy set, MADV_FREE is
+ *             used where available instead of MADV_DONTNEED.
+ *    Input: the policy, the idle page threshold, lazy purging
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_purge_policy(kma_purge_policy_t policy, int idle_pages, int lazy);
+
+/***********************************************************************
+ *  Title: Page geometry
+ * ---------------------------------------------------------------------
+ *    Purpose: Set the page size and the size of the pool. The pool
+ *             must not have any pages in use; it is torn down and
+ *             reserved again with the new geometry on the next
+ *             allocation. Pages cached by other threads must have been
+ *             released with page_release() before.
+ *    Input: the page size, a power of two between MINPAGESIZE and
+ *           MAXPAGESIZE, and the pool size in bytes, rounded up to
+ *           whole extents, or 0 for MAXEXTENTS extents
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_geometry(int page_size, long pool_size);
+
+/***********************************************************************
+ *  Title: Page coloring
+ * ---------------------------------------------------------------------
+ *    Purpose: Set the number of page colors. No pages may be in use,
+ *             since the algorithms find their per-page headers by the
+ *             color of the page. One color turns coloring off.
+ *    Input: the number of colors, a power of two up to MAXPAGECOLORS
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_coloring(int colors);
+
+/***********************************************************************
+ *  Title: Page retention policy
+ * ---------------------------------------------------------------------
+ *    Purpose: Select when empty extents are released. An empty extent
+ *             is kept while releasing it would leave fewer than
+ *             min_pages pages committed, and otherwise until it has
+ *             been empty for idle_ms milliseconds. Expired extents are
+ *             released the next time pages go back to the pool.
+ *    Input: the number of pages to retain, the idle timeout
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_retain_policy(int min_pages, int idle_ms);
+
+/***********************************************************************
+ *  Title: Release retained pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Hand the free pages cached by the calling thread and the
+ *             shared depot back to the pool, and release every empty
+ *             extent regardless of the retention policy
+ *    Input: none
+ *    Output: the number of extents released
+ ***********************************************************************/
+EXTERN int page_release();
+
+/***********************************************************************
+ *  Title: Page pool backing
+ * ---------------------------------------------------------------------
+ *    Purpose: Select what extents committed from now on are backed
+ *             with. BACKING_HUGETLB maps them onto reserved huge pages
+ *             and falls back to transparent huge pages, BACKING_THP
+ *             only asks for transparent huge pages. Either falls back
+ *             to base pages; page_stats() reports what the last extent
+ *             got. Free pages of hugetlb extents are never purged,
+ *             those of transparent huge page extents only a whole,
+ *             aligned huge page at a time.
+ *    Input: the requested backing
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_backing(kma_backing_t);
+
+/***********************************************************************
+ *  Title: Purge free pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Return all resident free pages to the operating system
+ *    Input: none
+ *    Output: the number of pages purged
+ ***********************************************************************/
+EXTERN int page_purge();
+
+/***********************************************************************
+ *  Title: Zero idle pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Clear up to count idle free pages with non-temporal
+ *             stores, off the hot path, and queue them for
+ *             get_zeroed_page()
+ *    Input: the number of pages to zero
+ *    Output: the number of pages zeroed
+ ***********************************************************************/
+EXTERN int page_prezero(int count);
+
+/***********************************************************************
+ *  Title: Share the page pool
+ * ---------------------------------------------------------------------
+ *    Purpose: Move the pool into a shared memory segment, so pages
+ *             handed out in one process can be used and freed in
+ *             another. With a name, the first process creates the
+ *             segment with shm_open() and the others attach to it,
+ *             adopting its page size, pool size and coloring. The
+ *             creator unlinks the name when it exits; processes
+ *             attached by then keep the pool. A segment no live
+ *             process uses is set up afresh instead of attached to.
+ *             Without one, an anonymous memfd is created, which is
+ *             shared with the children forked afterwards. The segment
+ *             is mapped at the same address in every process, so the
+ *             page pointers and descriptors are valid in all of them.
+ *             Call it before any pages are in use and before other
+ *             threads allocate. A shared pool does not cache pages
+ *             per thread and is never backed with huge pages.
+ *    Input: the shm_open() name, or NULL
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_share(char* name);
+
+/***********************************************************************
+ *  Title: Find the shared root
+ * ---------------------------------------------------------------------
+ *    Purpose: Return the room a shared pool reserves for the root of
+ *             the heap its processes allocate from. It is zero until
+ *             one of them writes it, and is only used with the root
+ *             lock held
+ *    Input: the size of the root, at most ROOTSIZE
+ *    Output: the root, or NULL if the pool is not shared
+ ***********************************************************************/
+EXTERN void* page_root(int size);
+
+/***********************************************************************
+ *  Title: Lock the shared root
+ * ---------------------------------------------------------------------
+ *    Purpose: Take the lock of the shared root, which is held across
+ *             the processes sharing the pool, so one at a time uses
+ *             the heap in it
+ *    Input: none
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_root_lock();
+
+/***********************************************************************
+ *  Title: Unlock the shared root
+ * ---------------------------------------------------------------------
+ *    Purpose: Release the lock taken by page_root_lock()
+ *    Input: none
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_root_unlock();
+
+/***********************************************************************
+ *  Title: Save the page pool
+ * ---------------------------------------------------------------------
+ *    Purpose: Write the pool, the pages in use and the allocator's
+ *             own state (its root, copied as is) to a file. Pages
+ *             cached by other threads must have been released with
+ *             page_release() before; a shared pool can not be saved.
+ *    Input: the file, the allocator's root and its size
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_snapshot(char* path, void* root, int size);
+
+/***********************************************************************
+ *  Title: Restore the page pool
+ * ---------------------------------------------------------------------
+ *    Purpose: Replace the empty pool with one saved by
+ *             page_snapshot(), adopting its page size and coloring.
+ *             The saved extents are mapped copy-on-write from the
+ *             file at the addresses they were saved from, so the
+ *             pointers stored in the pages and in the root stay
+ *             valid; nothing is relocated. If anything occupies the
+ *             saved pool or descriptor range, restore reports an
+ *             error before mapping from the file or touching the
+ *             root, leaving the pool empty as it was.
+ *    Input: the file, the allocator's root and its size, which must
+ *           match the saved one
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_restore(char* path, void* root, int size);
+
 /************External Declaration*****************************************/
 
 /**************Definition***************************************************/